@@ -0,0 +1,420 @@
+/*
+ * Throughput benchmark of the queue operations.
+ *
+ * Unlike qtest, this program links queue.c against the C library allocator
+ * and runs without time limits, so the figures are those of the queue code
+ * itself.  Every combination of queue size, string length distribution and
+ * input order is measured a few times, and the median is reported as
+ * machine-readable JSON or CSV.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Link against the regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+#include "queue.h"
+#include "strops.h"
+
+#define MIN_SIZE 1000
+#define DEFAULT_MAX_SIZE 1000000
+#define DEFAULT_REPS 3
+#define MAX_REPS 99
+
+/* Duplicated inputs draw from this many distinct strings per element */
+#define DUP_RATIO 16
+
+/* Length distributions of the generated strings, terminator excluded */
+typedef struct {
+    const char *name;
+    int min_len, max_len;
+} length_dist_t;
+
+static const length_dist_t lengths[] = {
+    {"short", 4, 12},  /* Stored inline */
+    {"long", 24, 64},  /* Stored out of line */
+    {"mixed", 1, 64},
+};
+#define NR_LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+typedef enum { ORDER_RANDOM, ORDER_SORTED, ORDER_REVERSED, ORDER_DUPS } order_t;
+
+static const char *const order_names[] = {
+    [ORDER_RANDOM] = "random",
+    [ORDER_SORTED] = "sorted",
+    [ORDER_REVERSED] = "reversed",
+    [ORDER_DUPS] = "dups",
+};
+#define NR_ORDERS (sizeof(order_names) / sizeof(order_names[0]))
+
+/* Input strings of one configuration */
+typedef struct {
+    char **strs;
+    char *buf;
+    size_t n;
+} input_t;
+
+/*
+ * A measured operation.  Its run function times the operation on a
+ * queue built from the input and returns the elapsed seconds.  Operations
+ * that are not sensitive to the order of the input are only measured on
+ * random input.
+ */
+typedef struct {
+    const char *name;
+    double (*run)(const input_t *in);
+    bool ordered;
+} bench_op_t;
+
+static bool use_pool = false;
+
+/* xoshiro256**, seeded the same on each run so inputs are reproducible */
+static str_rng_t rng;
+
+static uint64_t rng_next(void)
+{
+    return str_rng_next(&rng);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (!p) {
+        fprintf(stderr, "Out of memory allocating %zu bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static int cmp_up(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static int cmp_down(const void *a, const void *b)
+{
+    return -cmp_up(a, b);
+}
+
+static void random_string(char *s, const length_dist_t *dist)
+{
+    int len = dist->min_len + rng_next() % (dist->max_len - dist->min_len + 1);
+    str_fill_lower(&rng, s, len);
+    s[len] = '\0';
+}
+
+static void input_init(input_t *in,
+                       size_t n,
+                       const length_dist_t *dist,
+                       order_t order)
+{
+    size_t stride = dist->max_len + 1;
+    in->n = n;
+    in->strs = xmalloc(n * sizeof(char *));
+    in->buf = xmalloc(n * stride);
+    str_rng_seed(&rng, n);
+
+    size_t distinct = order == ORDER_DUPS ? n / DUP_RATIO + 1 : n;
+    for (size_t i = 0; i < distinct; i++) {
+        in->strs[i] = in->buf + i * stride;
+        random_string(in->strs[i], dist);
+    }
+    for (size_t i = distinct; i < n; i++)
+        in->strs[i] = in->strs[rng_next() % distinct];
+    for (size_t i = n - 1; order == ORDER_DUPS && i > 0; i--) {
+        size_t j = rng_next() % (i + 1);
+        char *tmp = in->strs[i];
+        in->strs[i] = in->strs[j];
+        in->strs[j] = tmp;
+    }
+
+    if (order == ORDER_SORTED)
+        qsort(in->strs, n, sizeof(char *), cmp_up);
+    else if (order == ORDER_REVERSED)
+        qsort(in->strs, n, sizeof(char *), cmp_down);
+}
+
+static void input_free(input_t *in)
+{
+    free(in->strs);
+    free(in->buf);
+}
+
+static struct list_head *queue_build(const input_t *in)
+{
+    struct list_head *q = use_pool ? q_new_pool() : q_new();
+    if (!q || !q_insert_tail_bulk(q, in->strs, in->n)) {
+        fprintf(stderr, "Could not build queue of %zu elements\n", in->n);
+        exit(EXIT_FAILURE);
+    }
+    return q;
+}
+
+static double run_insert(const input_t *in, bool tail)
+{
+    struct list_head *q = use_pool ? q_new_pool() : q_new();
+    double start = now();
+    for (size_t i = 0; i < in->n; i++) {
+        if (!(tail ? q_insert_tail(q, in->strs[i])
+                   : q_insert_head(q, in->strs[i]))) {
+            fprintf(stderr, "Insertion failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double elapsed = now() - start;
+    q_free(q);
+    return elapsed;
+}
+
+static double run_insert_head(const input_t *in)
+{
+    return run_insert(in, false);
+}
+
+static double run_insert_tail(const input_t *in)
+{
+    return run_insert(in, true);
+}
+
+static double run_insert_tail_bulk(const input_t *in)
+{
+    struct list_head *q = use_pool ? q_new_pool() : q_new();
+    double start = now();
+    bool ok = q_insert_tail_bulk(q, in->strs, in->n);
+    double elapsed = now() - start;
+    if (!ok) {
+        fprintf(stderr, "Bulk insertion failed\n");
+        exit(EXIT_FAILURE);
+    }
+    q_free(q);
+    return elapsed;
+}
+
+static double run_remove(const input_t *in, bool tail)
+{
+    char sp[128];
+    struct list_head *q = queue_build(in);
+    double start = now();
+    for (size_t i = 0; i < in->n; i++) {
+        element_t *e = tail ? q_remove_tail(q, sp, sizeof(sp))
+                            : q_remove_head(q, sp, sizeof(sp));
+        q_release_element(e);
+    }
+    double elapsed = now() - start;
+    q_free(q);
+    return elapsed;
+}
+
+static double run_remove_head(const input_t *in)
+{
+    return run_remove(in, false);
+}
+
+static double run_remove_tail(const input_t *in)
+{
+    return run_remove(in, true);
+}
+
+/* Time one call of an operation that goes over the whole queue */
+static double run_whole(const input_t *in,
+                        void (*prepare)(struct list_head *),
+                        void (*op)(struct list_head *))
+{
+    struct list_head *q = queue_build(in);
+    if (prepare)
+        prepare(q);
+    double start = now();
+    op(q);
+    double elapsed = now() - start;
+    q_free(q);
+    return elapsed;
+}
+
+static void delete_dup(struct list_head *q)
+{
+    q_delete_dup(q);
+}
+
+static double run_sort(const input_t *in)
+{
+    return run_whole(in, NULL, q_sort);
+}
+
+static double run_dedup(const input_t *in)
+{
+    /* q_delete_dup expects sorted input */
+    return run_whole(in, q_sort, delete_dup);
+}
+
+static double run_reverse(const input_t *in)
+{
+    return run_whole(in, NULL, q_reverse);
+}
+
+static double run_swap(const input_t *in)
+{
+    return run_whole(in, NULL, q_swap);
+}
+
+static const bench_op_t ops[] = {
+    {"insert_head", run_insert_head, false},
+    {"insert_tail", run_insert_tail, false},
+    {"insert_tail_bulk", run_insert_tail_bulk, false},
+    {"remove_head", run_remove_head, false},
+    {"remove_tail", run_remove_tail, false},
+    {"sort", run_sort, true},
+    {"dedup", run_dedup, true},
+    {"reverse", run_reverse, false},
+    {"swap", run_swap, false},
+};
+#define NR_OPS (sizeof(ops) / sizeof(ops[0]))
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-f FORMAT] [-o FILE] [-n MAX] [-r REPS] "
+           "[-t OP] [-p]\n",
+           cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-f FORMAT  Output json (default) or csv\n");
+    printf("\t-o FILE    Write results to FILE instead of stdout\n");
+    printf("\t-n MAX     Largest queue size, from %d in powers of ten "
+           "(default %d)\n",
+           MIN_SIZE, DEFAULT_MAX_SIZE);
+    printf("\t-r REPS    Runs per configuration, the median is reported "
+           "(default %d)\n",
+           DEFAULT_REPS);
+    printf("\t-t OP      Only measure operation OP\n");
+    printf("\t-p         Allocate elements from slab pools\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    bool csv = false;
+    char *outfile = NULL, *only = NULL;
+    long max_size = DEFAULT_MAX_SIZE;
+    int reps = DEFAULT_REPS;
+    int c;
+
+    /* Figures of kernels that disagree with the scalar ones are worthless */
+    if (!str_check()) {
+        fprintf(stderr, "%s string kernels disagree with scalar ones\n",
+                str_kernels());
+        return EXIT_FAILURE;
+    }
+
+    while ((c = getopt(argc, argv, "hf:o:n:r:t:p")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "csv"))
+                csv = true;
+            else if (strcmp(optarg, "json")) {
+                fprintf(stderr, "Unknown format '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'n':
+            max_size = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 't':
+            only = optarg;
+            break;
+        case 'p':
+            use_pool = true;
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (max_size < MIN_SIZE || reps < 1 || reps > MAX_REPS) {
+        fprintf(stderr, "Invalid size or repetition count\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = outfile ? fopen(outfile, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Cannot create '%s'\n", outfile);
+        return EXIT_FAILURE;
+    }
+
+    if (csv)
+        fprintf(out, "op,size,length,order,pool,ns_per_op,ops_per_sec\n");
+    else
+        fprintf(out, "{\"reps\": %d, \"pool\": %s, \"results\": [", reps,
+                use_pool ? "true" : "false");
+
+    bool first = true;
+    for (long n = MIN_SIZE; n <= max_size; n *= 10) {
+        for (size_t l = 0; l < NR_LENGTHS; l++) {
+            for (size_t o = 0; o < NR_ORDERS; o++) {
+                input_t in;
+                input_init(&in, n, &lengths[l], o);
+                for (size_t k = 0; k < NR_OPS; k++) {
+                    if ((!ops[k].ordered && o != ORDER_RANDOM) ||
+                        (only && strcmp(only, ops[k].name)))
+                        continue;
+
+                    double secs[MAX_REPS];
+                    for (int r = 0; r < reps; r++)
+                        secs[r] = ops[k].run(&in);
+                    qsort(secs, reps, sizeof(double), cmp_double);
+                    double median = reps % 2 ? secs[reps / 2]
+                                             : (secs[reps / 2 - 1] +
+                                                secs[reps / 2]) / 2;
+                    double ns = median * 1e9 / n;
+                    double rate = median > 0 ? n / median : 0;
+
+                    if (csv)
+                        fprintf(out, "%s,%ld,%s,%s,%d,%.2f,%.0f\n",
+                                ops[k].name, n, lengths[l].name,
+                                order_names[o], use_pool, ns, rate);
+                    else
+                        fprintf(out,
+                                "%s\n  {\"op\": \"%s\", \"size\": %ld, "
+                                "\"length\": \"%s\", \"order\": \"%s\", "
+                                "\"ns_per_op\": %.2f, \"ops_per_sec\": %.0f}",
+                                first ? "" : ",", ops[k].name, n,
+                                lengths[l].name, order_names[o], ns, rate);
+                    first = false;
+                    fflush(out);
+                }
+                input_free(&in);
+            }
+        }
+    }
+
+    if (!csv)
+        fprintf(out, "\n]}\n");
+    if (outfile && fclose(out)) {
+        fprintf(stderr, "Error writing '%s'\n", outfile);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -34,6 +35,8 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are mapped into memory instead, and lines are handed out
+ * straight from the mapping.
  */
 
 #define RIO_BUFSIZE 8192
@@ -44,12 +47,34 @@ struct RIO_ELE {
     int cnt;               /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Mapped file contents, NULL if not mapped */
+    size_t map_len;        /* Size of the mapping */
+    size_t map_pos;        /* Offset of next unread byte in the mapping */
     rio_ptr prev;          /* Next element in stack */
 };
 
 static rio_ptr buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/*
+ * Command lines are split into these buffers, which are reused for every
+ * line, so interpreting a command does not allocate.  Lines that do not fit
+ * are rejected.  As the buffers are shared, interpret_line() is not
+ * reentrant: a command that interprets another line loses its own
+ * arguments, and has to copy whatever it still needs from them first.
+ */
+#define MAXARGS (RIO_BUFSIZE / 2)
+static char argbuf[RIO_BUFSIZE];
+static char *argvbuf[MAXARGS];
+
+/*
+ * Commands and parameters are also indexed by name in open-addressing
+ * hash tables, so that looking one up does not walk the sorted lists.
+ */
+#define NAME_HASH_SIZE 256
+static cmd_ptr cmd_table[NAME_HASH_SIZE];
+static param_ptr param_table[NAME_HASH_SIZE];
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
@@ -76,6 +101,51 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of a command or parameter name */
+static size_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h & (NAME_HASH_SIZE - 1);
+}
+
+/*
+ * Find the slot for name in cmd_table or param_table.
+ * Return the index of the slot holding name, or of the empty slot to insert
+ * it into.
+ */
+static inline size_t cmd_slot(const char *name)
+{
+    size_t i = name_hash(name);
+    while (cmd_table[i] && strcmp(cmd_table[i]->name, name) != 0)
+        i = (i + 1) & (NAME_HASH_SIZE - 1);
+    return i;
+}
+
+static inline size_t param_slot(const char *name)
+{
+    size_t i = name_hash(name);
+    while (param_table[i] && strcmp(param_table[i]->name, name) != 0)
+        i = (i + 1) & (NAME_HASH_SIZE - 1);
+    return i;
+}
+
+static int cmd_cnt = 0;
+static int param_cnt = 0;
+
+static cmd_ptr find_cmd(const char *name)
+{
+    return cmd_table[cmd_slot(name)];
+}
+
+static param_ptr find_param(const char *name)
+{
+    return param_table[param_slot(name)];
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
@@ -92,6 +162,12 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->documentation = documentation;
     ele->next = next_cmd;
     *last_loc = ele;
+
+    /* Keep the table at most half full; a name added again wins */
+    cmd_ptr *slot = &cmd_table[cmd_slot(name)];
+    if (!*slot && ++cmd_cnt > NAME_HASH_SIZE / 2)
+        report_event(MSG_FATAL, "Exceeded limit on commands");
+    *slot = ele;
 }
 
 /* Add a new parameter */
@@ -114,52 +190,53 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+
+    param_ptr *slot = &param_table[param_slot(name)];
+    if (!*slot && ++param_cnt > NAME_HASH_SIZE / 2)
+        report_event(MSG_FATAL, "Exceeded limit on parameters");
+    *slot = ele;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/*
+ * Parse the len bytes at line into a command line.
+ * Words are copied into argbuf, each one null-terminated, and the returned
+ * argument vector points into it, so it is only valid until the next call.
+ * The line does not need to be null-terminated.
+ * Return NULL if the words do not fit into argbuf.
+ */
+static char **parse_args(const char *line, size_t len, int *argcp)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-    char *src = line;
-    char *dst = buf;
+    const char *src = line;
+    const char *src_end = line + len;
+    char *dst = argbuf;
+    char *end = argbuf + sizeof(argbuf) - 1;
     bool skipping = true;
     int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    while (src < src_end && (c = *src++) != '\0') {
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
+                if (dst >= end)
+                    return NULL;
                 *dst++ = '\0';
                 skipping = true;
             }
         } else {
+            if (dst >= end)
+                return NULL;
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                argvbuf[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
         }
     }
+    *dst = '\0';
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return argvbuf;
 }
 
 static void record_error()
@@ -177,10 +254,8 @@ static bool interpret_cmda(int argc, char *argv[])
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = find_cmd(argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
         ok = next_cmd->operation(argc, argv);
         if (!ok)
@@ -194,23 +269,29 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Execute a command from a command line of len bytes */
+bool interpret_line(const char *cmdline, size_t len)
 {
     if (quit_flag)
         return false;
 
 #if RPT >= 6
-    report(6, "Interpreting command '%s'\n", cmdline);
+    report(6, "Interpreting command '%.*s'\n", (int) len, cmdline);
 #endif
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    char **argv = parse_args(cmdline, len, &argc);
+    if (!argv) {
+        report(1, "Command line longer than %d bytes", RIO_BUFSIZE - 1);
+        record_error();
+        return false;
+    }
+    return interpret_cmda(argc, argv);
+}
 
-    return ok;
+/* Execute a command from a null-terminated command line */
+static bool interpret_cmd(char *cmdline)
+{
+    return interpret_line(cmdline, strlen(cmdline));
 }
 
 /* Set function to be executed as part of program exit */
@@ -245,6 +326,11 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_ele));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_cnt = param_cnt = 0;
 
     while (buf_stack)
         pop_file();
@@ -326,17 +412,14 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        /* Find parameter in table */
+        param_ptr plist = find_param(name);
+        if (plist) {
+            int oldval = *plist->valp;
+            *plist->valp = value;
+            if (plist->setter)
+                plist->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -402,6 +485,9 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_cnt = param_cnt = 0;
     err_cnt = 0;
     quit_flag = false;
 
@@ -440,9 +526,23 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = 0;
+    rnew->map_pos = 0;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
+    /* Map non-empty regular files, anything else goes through read() */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+        }
+    }
+
     return true;
 }
 
@@ -452,6 +552,8 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -463,10 +565,38 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
+/* Hand out the next line of a mapped input file, without copying it.
+ * When hit EOF, unmap and close that file and return NULL
+ */
+static char *readline_mapped(size_t *lenp)
+{
+    size_t left = buf_stack->map_len - buf_stack->map_pos;
+    if (!left) {
+        pop_file();
+        return NULL;
+    }
+
+    char *line = buf_stack->map + buf_stack->map_pos;
+    char *nl = memchr(line, '\n', left);
+    size_t len = nl ? (size_t) (nl - line) + 1 : left;
+    buf_stack->map_pos += len;
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        /* Last line of file may not terminate with newline */
+        report_noreturn(1, nl ? "%.*s" : "%.*s\n", (int) len, line);
+    }
+
+    *lenp = len;
+    return line;
+}
+
+/* Read command from input file into linebuf, or from its mapping.
+ * Store the line length at lenp, the line itself is null-terminated
+ * only when it is in linebuf.
  * When hit EOF, close that file and return NULL
  */
-static char *readline()
+static char *readline(size_t *lenp)
 {
     int cnt;
     char c;
@@ -475,6 +605,9 @@ static char *readline()
     if (!buf_stack)
         return NULL;
 
+    if (buf_stack->map)
+        return readline_mapped(lenp);
+
     for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
         if (buf_stack->cnt <= 0) {
             /* Need to read from input file */
@@ -492,6 +625,7 @@ static char *readline()
                         report_noreturn(1, prompt);
                         report_noreturn(1, linebuf);
                     }
+                    *lenp = lptr - linebuf - 1;
                     return linebuf;
                 }
                 return NULL;
@@ -517,6 +651,7 @@ static char *readline()
         report_noreturn(1, linebuf);
     }
 
+    *lenp = lptr - linebuf - 1;
     return linebuf;
 }
 
@@ -547,6 +682,15 @@ int cmd_select(int nfds,
     if (cmd_done())
         return 0;
 
+    /* Mapped input is always ready, skip select when nothing else waits */
+    if (!block_flag && nfds == 0 && has_infile && buf_stack->map) {
+        size_t len;
+        char *cmdline = readline(&len);
+        if (cmdline)
+            interpret_line(cmdline, len);
+        return 0;
+    }
+
     if (!block_flag) {
         /* Process any commands in input buffer */
         if (!readfds)
@@ -577,10 +721,10 @@ int cmd_select(int nfds,
         FD_CLR(infd, readfds);
         result--;
         if (has_infile) {
-            char *cmdline;
-            cmdline = readline();
+            size_t len;
+            char *cmdline = readline(&len);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_line(cmdline, len);
         }
     }
     return result;
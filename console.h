@@ -1,6 +1,7 @@
 #ifndef LAB0_CONSOLE_H
 #define LAB0_CONSOLE_H
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/select.h>
 #include "linenoise.h"
 #define HISTORY_FILE ".cmd_history"
@@ -51,6 +52,13 @@ void add_param(char *name,
                char *doccumentation,
                setter_function setter);
 
+/*
+ * Execute the command held in the first len bytes of cmdline.
+ * Arguments of the command running when this is called are overwritten,
+ * so this is not reentrant.  Lines too long to split are reported as errors.
+ */
+bool interpret_line(const char *cmdline, size_t len);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
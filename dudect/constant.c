@@ -10,8 +10,6 @@
 #include "queue.h"
 #include "random.h"
 
-#define N_MEASURE 150
-
 /* Allow random number range from 0 to 65535 */
 const size_t chunk_size = 16;
 
@@ -20,13 +18,8 @@ const size_t n_measure = N_MEASURE;
 
 const int drop_size = 20;
 
-/* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
- */
-static struct list_head *l = NULL;
-
-static char random_string[N_MEASURE][8];
-static int random_string_iter = 0;
+bool dut_ring = false;
+bool dut_compact = false;
 
 enum {
     test_insert_head,
@@ -36,18 +29,18 @@ enum {
 };
 
 /* Implement the necessary queue interface to simulation */
-void init_dut(void)
+void init_dut(dut_t *dut)
 {
-    l = NULL;
+    dut->random_string_iter = 0;
 }
 
-char *get_random_string(void)
+static char *get_random_string(dut_t *dut)
 {
-    random_string_iter = (random_string_iter + 1) % N_MEASURE;
-    return random_string[random_string_iter];
+    dut->random_string_iter = (dut->random_string_iter + 1) % N_MEASURE;
+    return dut->random_string[dut->random_string_iter];
 }
 
-void prepare_inputs(uint8_t *input_data, uint8_t *classes)
+void prepare_inputs(dut_t *dut, uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, n_measure * chunk_size);
     for (size_t i = 0; i < n_measure; i++) {
@@ -58,26 +51,32 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 
     for (size_t i = 0; i < N_MEASURE; ++i) {
         /* Generate random string */
-        randombytes((uint8_t *) random_string[i], 7);
-        random_string[i][7] = 0;
+        randombytes((uint8_t *) dut->random_string[i], 7);
+        dut->random_string[i][7] = 0;
     }
 }
 
-void measure(int64_t *before_ticks,
+void measure(dut_t *dut,
+             int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
 {
+    /* Maintain a queue independent from the qtest since
+     * we do not want the test to affect the original functionality
+     */
+    struct list_head *l = NULL;
+
     assert(mode == test_insert_head || mode == test_insert_tail ||
            mode == test_remove_head || mode == test_remove_tail);
 
     switch (mode) {
     case test_insert_head:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
+            char *s = get_random_string(dut);
             dut_new();
             dut_insert_head(
-                get_random_string(),
+                get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             dut_insert_head(s, 1);
@@ -87,10 +86,10 @@ void measure(int64_t *before_ticks,
         break;
     case test_insert_tail:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
+            char *s = get_random_string(dut);
             dut_new();
             dut_insert_head(
-                get_random_string(),
+                get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             dut_insert_tail(s, 1);
@@ -102,7 +101,7 @@ void measure(int64_t *before_ticks,
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
             dut_new();
             dut_insert_head(
-                get_random_string(),
+                get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             element_t *e = q_remove_head(l, NULL, 0);
@@ -116,7 +115,7 @@ void measure(int64_t *before_ticks,
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
             dut_new();
             dut_insert_head(
-                get_random_string(),
+                get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             element_t *e = q_remove_tail(l, NULL, 0);
@@ -130,7 +129,7 @@ void measure(int64_t *before_ticks,
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
             dut_new();
             dut_insert_head(
-                get_random_string(),
+                get_random_string(dut),
                 *(uint16_t *) (input_data + i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             dut_size(1);
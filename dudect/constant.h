@@ -1,8 +1,30 @@
 #ifndef DUDECT_CONSTANT_H
 #define DUDECT_CONSTANT_H
 
+#include <stdbool.h>
 #include <stdint.h>
-#define dut_new() ((void) (l = q_new()))
+
+#define N_MEASURE 150
+
+/*
+ * Measurement state of one thread.  Each worker keeps its own, together with
+ * the queue it builds inside measure().
+ */
+typedef struct {
+    char random_string[N_MEASURE][8];
+    int random_string_iter;
+} dut_t;
+
+/* Measure queues created by q_new_ring() instead of q_new() */
+extern bool dut_ring;
+
+/* Measure queues created by q_new_compact() instead of q_new() */
+extern bool dut_compact;
+
+#define dut_new()                                 \
+    ((void) (l = dut_ring      ? q_new_ring()    \
+                 : dut_compact ? q_new_compact() \
+                               : q_new()))
 
 #define dut_size(n)                                \
     do {                                           \
@@ -26,9 +48,10 @@
 
 #define dut_free() ((void) (q_free(l)))
 
-void init_dut();
-void prepare_inputs(uint8_t *input_data, uint8_t *classes);
-void measure(int64_t *before_ticks,
+void init_dut(dut_t *dut);
+void prepare_inputs(dut_t *dut, uint8_t *input_data, uint8_t *classes);
+void measure(dut_t *dut,
+             int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode);
@@ -4,6 +4,9 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of threads measuring in parallel, settable as option workers */
+extern int dudect_workers;
+
 /* Interface to test if function is constant */
 bool is_insert_head_const(void);
 bool is_insert_tail_const(void);
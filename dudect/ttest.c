@@ -28,6 +28,24 @@ void t_push(t_ctx *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/* Fold the samples of src into dst, as if they had all been pushed to dst.
+ * Uses the pairwise update of Chan, Golub and LeVeque for the variance.
+ */
+void t_merge(t_ctx *dst, const t_ctx *src)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = dst->n[class] + src->n[class];
+        if (n == 0)
+            continue;
+
+        double delta = src->mean[class] - dst->mean[class];
+        dst->mean[class] += delta * src->n[class] / n;
+        dst->m2[class] += src->m2[class] +
+                          delta * delta * dst->n[class] * src->n[class] / n;
+        dst->n[class] = n;
+    }
+}
+
 double t_compute(t_ctx *ctx)
 {
     double var[2] = {0.0, 0.0};
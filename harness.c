@@ -1,7 +1,10 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +21,9 @@
 /* Value at start of every allocated block */
 #define MAGICHEADER 0xdeadbeef
 
+/* Value at start of blocks rounded up to their magazine class instead */
+#define MAGICCLASS 0xdeadbee5
+
 /* Value when deallocate block */
 #define MAGICFREE 0xffffffff
 
@@ -27,29 +33,96 @@
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* Span filled at each end of a payload by the cache line fill policy */
+#define FILL_LINE 64
+
 /* Data structures used by our code */
 
-/*
- * Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header placed in front of every allocated block */
 typedef struct BELE {
-    struct BELE *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
-static size_t allocated_count = 0;
+/*
+ * Represent allocated blocks as open-addressing hash sets keyed by block
+ * address, so that cautious mode can validate a block in constant time.
+ * Freed entries turn into tombstones until the table is rebuilt.
+ * Blocks are spread over shards by the top bits of their hash, each with a
+ * lock of its own which is only taken in thread-safe mode, so threads only
+ * meet when their blocks land in the same shard.
+ */
+#define BLOCK_TOMBSTONE ((block_ele_t *) 1)
+#define BLOCK_SET_MIN 256
+#define BLOCK_SHARD_BITS 4
+#define BLOCK_SHARDS (1 << BLOCK_SHARD_BITS)
+
+typedef struct {
+    pthread_mutex_t lock;
+    block_ele_t **slots;
+    /* Number of slots, always a power of two */
+    size_t nslots;
+    /* Slots holding a block or a tombstone */
+    size_t used;
+    size_t count;
+} block_shard_t;
+
+static block_shard_t shards[BLOCK_SHARDS] = {
+    [0 ... BLOCK_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+/*
+ * In thread-safe mode each thread keeps up to MAGAZINE_SIZE freed blocks
+ * per class and hands them out again without going through the C library.
+ * Small blocks allocated in that mode are rounded up to a multiple of
+ * MAGAZINE_STEP bytes, so a freed one fits any later request of its class,
+ * and are marked with MAGICCLASS.  Only those go back to a magazine.
+ */
+#define MAGAZINE_STEP 16
+#define MAGAZINE_CLASSES 16
+#define MAGAZINE_SIZE 32
+
+typedef struct {
+    block_ele_t *blocks[MAGAZINE_SIZE];
+    int n;
+} magazine_t;
+
+/*
+ * Allocation state of one thread.  count is blocks allocated minus blocks
+ * freed by the thread, which goes negative when it frees blocks of
+ * others; allocation_check() adds up the counts of all threads.  bytes
+ * does the same for payload bytes.
+ */
+typedef struct thread_cache {
+    atomic_long count;
+    atomic_long bytes;
+    unsigned int seed;
+    magazine_t magazines[MAGAZINE_CLASSES];
+    struct thread_cache *next, *prev;
+} thread_cache_t;
+
+/* Used by the main thread, and by any thread outside of thread-safe mode */
+static thread_cache_t main_cache = {.next = &main_cache, .prev = &main_cache};
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Counts left behind by threads which exited */
+static atomic_long exited_count = 0;
+static atomic_long exited_bytes = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static __thread thread_cache_t *my_cache = NULL;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+enum { FILL_FULL, FILL_LINES, FILL_NONE };
+int fill_policy = FILL_FULL;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
+static bool threadsafe_mode = false;
+static atomic_bool error_occurred = false;
 static char *error_message = "";
 
 static int time_limit = 1;
@@ -65,18 +138,193 @@ static bool time_limited = false;
  * Internal functions
  */
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+static void magazines_flush(thread_cache_t *c)
+{
+    for (int i = 0; i < MAGAZINE_CLASSES; i++) {
+        magazine_t *m = &c->magazines[i];
+        while (m->n)
+            free(m->blocks[--m->n]);
+    }
+}
+
+/* Destructor of a thread's cache, at thread exit */
+static void cache_exit(void *arg)
+{
+    thread_cache_t *c = arg;
+    magazines_flush(c);
+    pthread_mutex_lock(&caches_lock);
+    atomic_fetch_add(&exited_count, atomic_load(&c->count));
+    atomic_fetch_add(&exited_bytes, atomic_load(&c->bytes));
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    pthread_mutex_unlock(&caches_lock);
+    free(c);
+}
+
+static void cache_key_create()
+{
+    pthread_key_create(&cache_key, cache_exit);
+}
+
+static thread_cache_t *get_cache()
+{
+    if (my_cache)
+        return my_cache;
+
+    if (!threadsafe_mode) {
+        my_cache = &main_cache;
+        return my_cache;
+    }
+
+    /*
+     * Threads cannot fall back on main_cache, whose magazines and seed are
+     * not guarded against other threads.
+     */
+    pthread_once(&cache_key_once, cache_key_create);
+    thread_cache_t *c = calloc(1, sizeof(thread_cache_t));
+    if (!c || pthread_setspecific(cache_key, c)) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        free(c);
+        return NULL;
+    }
+    c->seed = (unsigned int) (uintptr_t) c;
+    pthread_mutex_lock(&caches_lock);
+    c->next = main_cache.next;
+    c->prev = &main_cache;
+    main_cache.next->prev = c;
+    main_cache.next = c;
+    pthread_mutex_unlock(&caches_lock);
+    my_cache = c;
+    return c;
+}
+
+/* Uncontended but for threads sharing main_cache */
+static inline void cache_count(thread_cache_t *c, long delta, long bytes)
+{
+    atomic_fetch_add_explicit(&c->count, delta, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->bytes, bytes, memory_order_relaxed);
+}
+
+/*
+ * Should this allocation fail?
+ * Threads draw from random numbers of their own in thread-safe mode, since
+ * random() serializes on a lock.
+ */
+static bool fail_allocation(thread_cache_t *c)
 {
-    double weight = (double) random() / RAND_MAX;
+    double weight = threadsafe_mode ? (double) rand_r(&c->seed) / RAND_MAX
+                                    : (double) random() / RAND_MAX;
     return (weight < 0.01 * fail_probability);
 }
 
+static inline size_t block_hash(const block_ele_t *b)
+{
+    /* Fibonacci hashing, dropping the bits malloc alignment leaves zero */
+    return (size_t) ((((uintptr_t) b >> 4) * 0x9E3779B97F4A7C15ULL) >> 16);
+}
+
+static inline block_shard_t *block_shard(const block_ele_t *b)
+{
+    /* block_hash() yields 48 bits, slots are taken from the low ones */
+    return &shards[block_hash(b) >> (48 - BLOCK_SHARD_BITS)];
+}
+
+static inline void shard_lock(block_shard_t *shard)
+{
+    if (threadsafe_mode)
+        pthread_mutex_lock(&shard->lock);
+}
+
+static inline void shard_unlock(block_shard_t *shard)
+{
+    if (threadsafe_mode)
+        pthread_mutex_unlock(&shard->lock);
+}
+
+/* Return the slot holding b, or NULL if b is not an allocated block */
+static block_ele_t **block_lookup(block_shard_t *shard, const block_ele_t *b)
+{
+    if (!shard->slots)
+        return NULL;
+
+    size_t mask = shard->nslots - 1;
+    for (size_t i = block_hash(b) & mask;; i = (i + 1) & mask) {
+        if (shard->slots[i] == b)
+            return &shard->slots[i];
+        if (!shard->slots[i])
+            return NULL;
+    }
+}
+
+/* Rebuild the shard with room for at least twice its live blocks */
+static void block_set_rehash(block_shard_t *shard)
+{
+    size_t slots = BLOCK_SET_MIN;
+    while (slots < 4 * (shard->count + 1))
+        slots <<= 1;
+
+    block_ele_t **table = calloc(slots, sizeof(block_ele_t *));
+    if (!table) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        return;
+    }
+    for (size_t i = 0; i < shard->nslots; i++) {
+        block_ele_t *b = shard->slots[i];
+        if (!b || b == BLOCK_TOMBSTONE)
+            continue;
+        size_t j = block_hash(b) & (slots - 1);
+        while (table[j])
+            j = (j + 1) & (slots - 1);
+        table[j] = b;
+    }
+    free(shard->slots);
+    shard->slots = table;
+    shard->nslots = slots;
+    shard->used = shard->count;
+}
+
+static void block_set_add(block_ele_t *b)
+{
+    block_shard_t *shard = block_shard(b);
+    shard_lock(shard);
+
+    /* Keep the load, tombstones included, under three quarters */
+    if (4 * (shard->used + 1) > 3 * shard->nslots)
+        block_set_rehash(shard);
+
+    size_t mask = shard->nslots - 1;
+    size_t i = block_hash(b) & mask;
+    while (shard->slots[i] && shard->slots[i] != BLOCK_TOMBSTONE)
+        i = (i + 1) & mask;
+    if (!shard->slots[i])
+        shard->used++;
+    shard->slots[i] = b;
+    shard->count++;
+
+    shard_unlock(shard);
+}
+
+/* Drop b from the set, return false if it was not in there */
+static bool block_set_remove(const block_ele_t *b)
+{
+    block_shard_t *shard = block_shard(b);
+    shard_lock(shard);
+    block_ele_t **slot = block_lookup(shard, b);
+    if (slot) {
+        *slot = BLOCK_TOMBSTONE;
+        shard->count--;
+    }
+    shard_unlock(shard);
+    return slot;
+}
+
 /*
- * Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+ * Find header of block, given its payload, and drop the block from the set
+ * of allocated blocks.
+ * Signal error if doesn't seem like legitimate block, and say in *tracked
+ * whether it was in the set
  */
-static block_ele_t *find_header(void *p)
+static block_ele_t *find_header(void *p, bool *tracked)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
@@ -84,15 +332,11 @@ static block_ele_t *find_header(void *p)
     }
 
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    /* A block freed twice is no longer in the set on the second call */
+    *tracked = block_set_remove(b);
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!*tracked) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -100,7 +344,7 @@ static block_ele_t *find_header(void *p)
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICCLASS) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -111,6 +355,24 @@ static block_ele_t *find_header(void *p)
     return b;
 }
 
+/* Fill payload p of size bytes with FILLCHAR as far as the policy asks */
+static void fill_payload(unsigned char *p, size_t size)
+{
+    switch (fill_policy) {
+    case FILL_NONE:
+        return;
+    case FILL_LINES:
+        if (size > 2 * FILL_LINE) {
+            memset(p, FILLCHAR, FILL_LINE);
+            memset(p + size - FILL_LINE, FILLCHAR, FILL_LINE);
+            return;
+        }
+        /* Fall through: small payloads are covered by their edges anyway */
+    default:
+        memset(p, FILLCHAR, size);
+    }
+}
+
 /* Given pointer to block, find its footer */
 static size_t *find_footer(block_ele_t *b)
 {
@@ -119,6 +381,18 @@ static size_t *find_footer(block_ele_t *b)
     return p;
 }
 
+/*
+ * Magazine class of a block holding size payload bytes, or -1 if the block
+ * is too large to be cached.
+ */
+static inline int block_class(size_t size)
+{
+    size_t total = size + sizeof(block_ele_t) + sizeof(size_t);
+    if (total > MAGAZINE_STEP * MAGAZINE_CLASSES)
+        return -1;
+    return (total - 1) / MAGAZINE_STEP;
+}
+
 /*
  * Implementation of application functions
  */
@@ -129,34 +403,34 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
-    if (fail_allocation()) {
+    thread_cache_t *c = get_cache();
+    if (fail_allocation(c)) {
         report_event(MSG_WARN, "Malloc returning NULL");
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+    int k = threadsafe_mode ? block_class(size) : -1;
+    block_ele_t *new_block = NULL;
+    if (k >= 0 && c->magazines[k].n)
+        new_block = c->magazines[k].blocks[--c->magazines[k].n];
+    else if (k >= 0)
+        new_block = malloc((k + 1) * MAGAZINE_STEP);
+    else
+        new_block = malloc(size + sizeof(block_ele_t) + sizeof(size_t));
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
+    new_block->magic_header = k >= 0 ? MAGICCLASS : MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    fill_payload(p, size);
+    block_set_add(new_block);
+    cache_count(c, 1, size);
 
     return p;
 }
@@ -183,31 +457,45 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_ele_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
+    bool tracked;
+    block_ele_t *b = find_header(p, &tracked);
+    /*
+     * Once reported, a block which is not tracked is left alone: it may sit
+     * in a magazine already, or not be a block at all.
+     */
+    if (!tracked)
+        return;
+
+    thread_cache_t *c = get_cache();
+    size_t magic = b->magic_header;
+    if (magic != MAGICHEADER && magic != MAGICCLASS) {
+        /* The size in front of the magic number cannot be trusted either */
+        cache_count(c, -1, 0);
+        return;
+    }
+    cache_count(c, -1, -(long) b->payload_size);
+    b->magic_header = MAGICFREE;
+    if (*find_footer(b) != MAGICFOOTER) {
         report_event(MSG_ERROR,
                      "Corruption detected in block with address %p when "
                      "attempting to free it",
                      p);
         error_occurred = true;
+        /* The overrun may have reached the C library's own data */
+        return;
     }
-    b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
 
-    /* Unlink from list */
-    block_ele_t *bn = b->next;
-    block_ele_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    *find_footer(b) = MAGICFREE;
+    fill_payload(p, b->payload_size);
 
+    /* Cached blocks keep MAGICFREE, so freeing one again is still caught */
+    int k = block_class(b->payload_size);
+    if (magic == MAGICCLASS && threadsafe_mode &&
+        c->magazines[k].n < MAGAZINE_SIZE) {
+        c->magazines[k].blocks[c->magazines[k].n++] = b;
+        return;
+    }
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
@@ -223,7 +511,39 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    pthread_mutex_lock(&caches_lock);
+    long count = atomic_load(&exited_count);
+    thread_cache_t *c = &main_cache;
+    do {
+        count += atomic_load(&c->count);
+        c = c->next;
+    } while (c != &main_cache);
+    pthread_mutex_unlock(&caches_lock);
+    return count;
+}
+
+size_t allocation_bytes()
+{
+    pthread_mutex_lock(&caches_lock);
+    long bytes = atomic_load(&exited_bytes);
+    thread_cache_t *c = &main_cache;
+    do {
+        bytes += atomic_load(&c->bytes);
+        c = c->next;
+    } while (c != &main_cache);
+    pthread_mutex_unlock(&caches_lock);
+    return bytes;
+}
+
+bool allocation_tracked(const void *p)
+{
+    const block_ele_t *b =
+        (const block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    block_shard_t *shard = block_shard(b);
+    shard_lock(shard);
+    bool tracked = block_lookup(shard, b);
+    shard_unlock(shard);
+    return tracked;
 }
 
 /*
@@ -248,14 +568,26 @@ void set_noallocate_mode(bool noallocate)
     noallocate_mode = noallocate;
 }
 
+/*
+ * Set/unset thread-safe mode.
+ * In this mode, several threads can run queue code at once.  Each thread
+ * counts its own blocks and keeps recently freed ones for reuse, and the
+ * block set is only locked shard by shard.  Only switch while a single
+ * thread is running.
+ */
+void set_threadsafe_mode(bool threadsafe)
+{
+    if (!threadsafe && my_cache)
+        magazines_flush(my_cache);
+    threadsafe_mode = threadsafe;
+}
+
 /*
  * Return whether any errors have occurred since last time set error limit
  */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /*
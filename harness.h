@@ -22,9 +22,22 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Report number of payload bytes in allocated blocks */
+size_t allocation_bytes();
+
+/* Return true if p is the payload of an allocated block */
+bool allocation_tracked(const void *p);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * How payloads get filled with garbage on malloc and free.
+ * 0 fills the whole payload, 1 only its first and last cache lines, and
+ * 2 leaves it untouched.  Header and footer checks apply in every mode.
+ */
+extern int fill_policy;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -37,6 +50,13 @@ void set_cautious_mode(bool cautious);
  */
 void set_noallocate_mode(bool noallocate);
 
+/*
+ * Set/unset thread-safe mode.
+ * In this mode, malloc and free may be called from several threads at once.
+ * Freed blocks are then cached per thread and checked as usual.
+ */
+void set_threadsafe_mode(bool threadsafe);
+
 /*
   Return whether any errors have occurred since last time checked
  */
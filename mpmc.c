@@ -0,0 +1,263 @@
+#include "mpmc.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "strops.h"
+
+/* Hazard pointers per thread: the head or tail, and the node after head */
+#define MPMC_HAZARDS 2
+
+#define MPMC_CACHE_LINE 64
+
+typedef struct mpmc_node {
+    _Atomic(struct mpmc_node *) next;
+    char *value;
+} mpmc_node_t;
+
+/*
+ * The harness does not hand out cache line aligned memory, so fields which
+ * different threads write are kept apart by padding instead.
+ */
+struct mpmc_handle {
+    _Atomic(mpmc_node_t *) hazard[MPMC_HAZARDS];
+    atomic_bool attached;
+    mpmc_t *q;
+    /* Nodes taken off the queue, freed once no hazard points at them */
+    mpmc_node_t **retired;
+    size_t nretired;
+    char pad[MPMC_CACHE_LINE];
+};
+
+struct mpmc {
+    _Atomic(mpmc_node_t *) head;
+    char pad[MPMC_CACHE_LINE];
+    _Atomic(mpmc_node_t *) tail;
+    int nhandles;
+    /* Retired nodes a thread collects before it scans the hazards */
+    size_t retire_limit;
+    mpmc_handle_t *handles;
+};
+
+mpmc_t *mpmc_new(int max_threads)
+{
+    if (max_threads < 1) {
+        return NULL;
+    }
+    mpmc_t *q = malloc(sizeof(mpmc_t));
+    if (!q) {
+        return NULL;
+    }
+    mpmc_node_t *dummy = malloc(sizeof(mpmc_node_t));
+    q->handles = malloc(max_threads * sizeof(mpmc_handle_t));
+    if (!dummy || !q->handles) {
+        free(dummy);
+        free(q->handles);
+        free(q);
+        return NULL;
+    }
+    memset(q->handles, 0, max_threads * sizeof(mpmc_handle_t));
+
+    /* A scan frees all but the nodes still hazardous, at least half */
+    q->nhandles = max_threads;
+    q->retire_limit = 2 * MPMC_HAZARDS * max_threads;
+    for (int i = 0; i < max_threads; i++) {
+        mpmc_handle_t *h = &q->handles[i];
+        h->q = q;
+        h->retired = malloc(q->retire_limit * sizeof(mpmc_node_t *));
+        if (!h->retired) {
+            while (i--) {
+                free(q->handles[i].retired);
+            }
+            free(q->handles);
+            free(dummy);
+            free(q);
+            return NULL;
+        }
+    }
+
+    atomic_init(&dummy->next, NULL);
+    dummy->value = NULL;
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+    return q;
+}
+
+void mpmc_free(mpmc_t *q)
+{
+    if (!q) {
+        return;
+    }
+    /* The value of the dummy at the head has been popped already */
+    mpmc_node_t *node = atomic_load(&q->head);
+    mpmc_node_t *next = atomic_load(&node->next);
+    free(node);
+    for (node = next; node; node = next) {
+        next = atomic_load(&node->next);
+        free(node->value);
+        free(node);
+    }
+
+    for (int i = 0; i < q->nhandles; i++) {
+        mpmc_handle_t *h = &q->handles[i];
+        for (size_t j = 0; j < h->nretired; j++) {
+            free(h->retired[j]);
+        }
+        free(h->retired);
+    }
+    free(q->handles);
+    free(q);
+}
+
+mpmc_handle_t *mpmc_attach(mpmc_t *q)
+{
+    for (int i = 0; i < q->nhandles; i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&q->handles[i].attached, &expected,
+                                           true)) {
+            return &q->handles[i];
+        }
+    }
+    return NULL;
+}
+
+void mpmc_detach(mpmc_handle_t *h)
+{
+    for (int i = 0; i < MPMC_HAZARDS; i++) {
+        atomic_store(&h->hazard[i], NULL);
+    }
+    atomic_store(&h->attached, false);
+}
+
+/*
+ * Publish the node *src points to in hazard slot i.  The node is safe to
+ * use once src is seen unchanged after publishing, since a node is only
+ * retired after it has been unlinked.
+ */
+static mpmc_node_t *protect(mpmc_handle_t *h,
+                            int i,
+                            _Atomic(mpmc_node_t *) *src)
+{
+    mpmc_node_t *p = atomic_load(src);
+    for (;;) {
+        atomic_store(&h->hazard[i], p);
+        mpmc_node_t *again = atomic_load(src);
+        if (again == p) {
+            return p;
+        }
+        p = again;
+    }
+}
+
+static bool is_hazard(mpmc_t *q, mpmc_node_t *node)
+{
+    for (int i = 0; i < q->nhandles; i++) {
+        for (int j = 0; j < MPMC_HAZARDS; j++) {
+            if (atomic_load(&q->handles[i].hazard[j]) == node) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Free the retired nodes no thread holds a hazard pointer to */
+static void scan(mpmc_handle_t *h)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < h->nretired; i++) {
+        mpmc_node_t *node = h->retired[i];
+        if (is_hazard(h->q, node)) {
+            h->retired[kept++] = node;
+        } else {
+            free(node);
+        }
+    }
+    h->nretired = kept;
+}
+
+static void retire(mpmc_handle_t *h, mpmc_node_t *node)
+{
+    h->retired[h->nretired++] = node;
+    if (h->nretired == h->q->retire_limit) {
+        scan(h);
+    }
+}
+
+bool mpmc_push(mpmc_handle_t *h, const char *s)
+{
+    mpmc_t *q = h->q;
+    mpmc_node_t *node = malloc(sizeof(mpmc_node_t));
+    if (!node) {
+        return false;
+    }
+    node->value = strdup(s);
+    if (!node->value) {
+        free(node);
+        return false;
+    }
+    atomic_init(&node->next, NULL);
+
+    for (;;) {
+        mpmc_node_t *tail = protect(h, 0, &q->tail);
+        mpmc_node_t *next = atomic_load(&tail->next);
+        if (tail != atomic_load(&q->tail)) {
+            continue;
+        }
+        if (next) {
+            /* Help a push which linked its node but did not move tail */
+            atomic_compare_exchange_strong(&q->tail, &tail, next);
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&tail->next, &next, node)) {
+            atomic_compare_exchange_strong(&q->tail, &tail, node);
+            break;
+        }
+    }
+    atomic_store(&h->hazard[0], NULL);
+    return true;
+}
+
+bool mpmc_pop(mpmc_handle_t *h, char *sp, size_t bufsize)
+{
+    mpmc_t *q = h->q;
+    mpmc_node_t *head, *next;
+
+    for (;;) {
+        head = protect(h, 0, &q->head);
+        mpmc_node_t *tail = atomic_load(&q->tail);
+        next = atomic_load(&head->next);
+        atomic_store(&h->hazard[1], next);
+        if (head != atomic_load(&q->head)) {
+            continue;
+        }
+        if (!next) {
+            atomic_store(&h->hazard[0], NULL);
+            atomic_store(&h->hazard[1], NULL);
+            return false;
+        }
+        if (head == tail) {
+            /* Tail lags behind a linked node, move it on before head */
+            atomic_compare_exchange_strong(&q->tail, &tail, next);
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&q->head, &head, next)) {
+            break;
+        }
+    }
+
+    /*
+     * next is the new dummy.  Only the thread which moved head past it
+     * takes its value, and hazard 1 keeps it from being freed meanwhile.
+     */
+    char *value = next->value;
+    if (sp) {
+        str_copy_out(sp, value, strlen(value), bufsize);
+    }
+    free(value);
+    atomic_store(&h->hazard[0], NULL);
+    atomic_store(&h->hazard[1], NULL);
+    retire(h, head);
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef LAB0_MPMC_H
+#define LAB0_MPMC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Unbounded multi-producer, multi-consumer queue of strings.
+ *
+ * This is the lock-free queue of Michael and Scott: a singly-linked list
+ * with a dummy node at the head, where producers link new nodes after the
+ * tail and consumers swing the head forward with compare-and-swap.  Nodes
+ * taken off the head are reclaimed with hazard pointers, so a thread never
+ * frees a node that another one may still be reading.
+ *
+ * Every thread using the queue attaches first and passes its handle to
+ * each call.  Strings are copied in on push and out on pop, as with
+ * q_insert_tail() and q_remove_head().  Elements are allocated through the
+ * harness, which has to be in thread-safe mode while several threads run.
+ */
+
+typedef struct mpmc mpmc_t;
+typedef struct mpmc_handle mpmc_handle_t;
+
+/*
+ * Create empty queue for up to max_threads attached threads.
+ * Return NULL if could not allocate space.
+ */
+mpmc_t *mpmc_new(int max_threads);
+
+/*
+ * Free ALL storage used by queue, including elements not popped yet.
+ * No thread may use the queue any more.  No effect if q is NULL.
+ */
+void mpmc_free(mpmc_t *q);
+
+/*
+ * Claim a handle for the calling thread.
+ * Return NULL if max_threads handles are attached already.
+ */
+mpmc_handle_t *mpmc_attach(mpmc_t *q);
+
+/* Give the handle back, another thread may attach with it afterwards */
+void mpmc_detach(mpmc_handle_t *h);
+
+/*
+ * Append a copy of s at the tail.
+ * Return false if could not allocate space.
+ */
+bool mpmc_push(mpmc_handle_t *h, const char *s);
+
+/*
+ * Take the element at the head.
+ * If sp is non-NULL, copy its string to *sp (up to a maximum of bufsize-1
+ * characters, plus a null terminator.)
+ * Return false if the queue was empty.
+ */
+bool mpmc_pop(mpmc_handle_t *h, char *sp, size_t bufsize);
+
+#endif /* LAB0_MPMC_H */
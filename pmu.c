@@ -0,0 +1,97 @@
+#include "pmu.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "report.h"
+
+const char *const pmu_names[PMU_NR] = {
+    [PMU_INSTRUCTIONS] = "instructions",
+    [PMU_CACHE_MISSES] = "cache-misses",
+    [PMU_BRANCH_MISSES] = "branch-misses",
+};
+
+int pmu_enabled = 0;
+
+/* File descriptors of the group, the first one leads */
+static int pmu_fds[PMU_NR] = {-1, -1, -1};
+
+#ifdef __linux__
+static const uint64_t pmu_configs[PMU_NR] = {
+    [PMU_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [PMU_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+    [PMU_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+bool pmu_open(void)
+{
+    if (pmu_fds[0] >= 0) {
+        pmu_enabled = 1;
+        return true;
+    }
+
+    for (int i = 0; i < PMU_NR; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = pmu_configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        pmu_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+                             i == 0 ? -1 : pmu_fds[0], 0);
+        if (pmu_fds[i] < 0) {
+            report(1,
+                   "Cannot open %s counter (%s).  Using plain timing only",
+                   pmu_names[i], strerror(errno));
+            pmu_close();
+            return false;
+        }
+    }
+
+    ioctl(pmu_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pmu_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    pmu_enabled = 1;
+    return true;
+}
+
+bool pmu_read(pmu_sample_t *s)
+{
+    /* Layout of PERF_FORMAT_GROUP: the number of counters, then the values */
+    uint64_t buf[1 + PMU_NR];
+    if (read(pmu_fds[0], buf, sizeof(buf)) != sizeof(buf) || buf[0] != PMU_NR)
+        return false;
+    memcpy(s->v, buf + 1, sizeof(s->v));
+    return true;
+}
+#else /* !__linux__ */
+bool pmu_open(void)
+{
+    report(1, "Hardware counters are not supported.  Using plain timing only");
+    pmu_enabled = 0;
+    return false;
+}
+
+bool pmu_read(pmu_sample_t *s)
+{
+    return false;
+}
+#endif
+
+void pmu_close(void)
+{
+    for (int i = PMU_NR - 1; i >= 0; i--) {
+        if (pmu_fds[i] >= 0)
+            close(pmu_fds[i]);
+        pmu_fds[i] = -1;
+    }
+    pmu_enabled = 0;
+}
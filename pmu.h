@@ -0,0 +1,42 @@
+#ifndef LAB0_PMU_H
+#define LAB0_PMU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Hardware performance counters, read as one perf_event group so that the
+ * counts of an operation all cover the same instructions.  Only user space
+ * is counted.
+ */
+
+typedef enum {
+    PMU_INSTRUCTIONS,
+    PMU_CACHE_MISSES,
+    PMU_BRANCH_MISSES,
+    PMU_NR,
+} pmu_event_t;
+
+typedef struct {
+    uint64_t v[PMU_NR];
+} pmu_sample_t;
+
+/* Names of the counters, for reports */
+extern const char *const pmu_names[PMU_NR];
+
+/* Nonzero while the counter group is open.  Settable as option pmu */
+extern int pmu_enabled;
+
+/*
+ * Open and start the counter group.
+ * Return false, leaving pmu_enabled clear, if the host does not allow it.
+ */
+bool pmu_open(void);
+
+/* Stop and close the counter group */
+void pmu_close(void);
+
+/* Read the current counts.  Return false if the counters could not be read */
+bool pmu_read(pmu_sample_t *s);
+
+#endif /* LAB0_PMU_H */
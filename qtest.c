@@ -1,19 +1,28 @@
 /* Implementation of testing code for queue code */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h> /* strcasecmp */
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "dudect/constant.h"
 #include "dudect/fixture.h"
 #include "list.h"
+#include "mpmc.h"
+#include "pmu.h"
+#include "random.h"
 
 /* Our program needs to use regular malloc/free */
 #define INTERNAL 1
@@ -35,6 +44,7 @@
 
 #include "console.h"
 #include "report.h"
+#include "stats.h"
 
 /* Settable parameters */
 
@@ -43,7 +53,6 @@
 /*
  * How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST 30
 static int big_list_size = BIG_LIST;
@@ -56,6 +65,8 @@ typedef struct {
     struct list_head *l;
     /* meta data of list */
     int size;
+    /* Allocated blocks the queue held when it was last deselected */
+    size_t blocks;
 } list_head_meta_t;
 
 static list_head_meta_t l_meta;
@@ -63,19 +74,98 @@ static list_head_meta_t l_meta;
 /* Number of elements in queue */
 static size_t lcnt = 0;
 
+/*
+ * Registry of queues, numbered by their slot.  l_meta and lcnt belong to
+ * the selected queue, whose slot is only brought up to date when another
+ * queue gets selected.
+ */
+#define MAX_QUEUES 64
+static list_head_meta_t queues[MAX_QUEUES];
+static int cur_queue = 0;
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST;
 static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Carve elements of newly created queues from a slab pool */
+static int use_pool = 0;
+
+/* Sorting algorithm used by sort: 0 for linked list, 1 for key array */
+static int sort_algo = 0;
+
+/* Number of threads the linked list sort may use */
+static int sort_threads = 1;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
-static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+/* Source of random strings, seeded along with the C library generator */
+static str_rng_t rand_rng;
+/* Seed of all random generators, 0 for a fresh one */
+static int random_seed = 0;
 
 /* Forward declarations */
 static bool show_queue(int vlevel);
 
+/* Blocks held by the queues besides the selected one */
+static size_t other_blocks()
+{
+    size_t cnt = 0;
+    for (int i = 0; i < MAX_QUEUES; i++) {
+        if (i != cur_queue && queues[i].l)
+            cnt += queues[i].blocks;
+    }
+    return cnt;
+}
+
+/*
+ * All allocated blocks the other queues do not hold belong to the selected
+ * one, so its share is taken whenever another queue gets selected.
+ */
+static void select_queue(int id)
+{
+    size_t bcnt = allocation_check(), held = other_blocks();
+    l_meta.blocks = bcnt > held ? bcnt - held : 0;
+    queues[cur_queue] = l_meta;
+    cur_queue = id;
+    l_meta = queues[id];
+    lcnt = l_meta.size;
+}
+
+/*
+ * Return the number of blocks left behind by freeing the selected queue,
+ * which are those beyond what the other queues hold.
+ */
+static size_t leaked_blocks()
+{
+    size_t bcnt = allocation_check(), held = other_blocks();
+    return bcnt > held ? bcnt - held : 0;
+}
+
+/*
+ * Blocks the elements of a queue q_merge() or q_split() works on hold: the
+ * node of each, and its string if that is allocated on its own.
+ */
+static size_t element_blocks(struct list_head *head)
+{
+    size_t cnt = 0;
+    element_t *e;
+    list_for_each_entry (e, head, list)
+        cnt += 1 + allocation_tracked(e->value);
+    return cnt;
+}
+
+/* Lowest free slot other than the selected one, -1 if there is none */
+static int free_slot()
+{
+    for (int i = 0; i < MAX_QUEUES; i++) {
+        if (i != cur_queue && !queues[i].l)
+            return i;
+    }
+    return -1;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -88,19 +178,20 @@ static bool do_free(int argc, char *argv[])
         report(3, "Warning: Calling free on null queue");
     error_check();
 
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
         q_free(l_meta.l);
+        stats_end(STAT_FREE, t);
+    }
     exception_cancel();
-    set_cautious_mode(true);
 
     l_meta.size = 0;
     l_meta.l = NULL;
     lcnt = 0;
     show_queue(3);
 
-    size_t bcnt = allocation_check();
+    /* Blocks of the other queues are still allocated */
+    size_t bcnt = leaked_blocks();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
@@ -110,22 +201,55 @@ static bool do_free(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Backends a queue can be kept in */
+enum { QUEUE_LIST, QUEUE_RING, QUEUE_COMPACT };
+
+/* Return the backend named type, or -1 if there is none by that name */
+static int queue_kind(const char *type)
+{
+    if (!strcmp(type, "ring"))
+        return QUEUE_RING;
+    if (!strcmp(type, "compact"))
+        return QUEUE_COMPACT;
+    return -1;
+}
+
+/* Create a queue of the given backend, which simulation measures as well */
+static struct list_head *queue_create(int kind)
+{
+    dut_ring = kind == QUEUE_RING;
+    dut_compact = kind == QUEUE_COMPACT;
+    if (kind == QUEUE_RING)
+        return q_new_ring();
+    if (kind == QUEUE_COMPACT)
+        return q_new_compact();
+    return use_pool ? q_new_pool() : q_new();
+}
+
 static bool do_new(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int kind = argc == 2 ? queue_kind(argv[1]) : QUEUE_LIST;
+    if (kind < 0) {
+        report(1, "Unknown queue type '%s'", argv[1]);
         return false;
     }
 
     bool ok = true;
     if (l_meta.l) {
         report(3, "Freeing old queue");
-        ok = do_free(argc, argv);
+        ok = do_free(1, argv);
     }
     error_check();
 
     if (exception_setup(true)) {
-        l_meta.l = q_new();
+        int64_t t = stats_begin();
+        l_meta.l = queue_create(kind);
+        stats_end(STAT_NEW, t);
         l_meta.size = 0;
     }
     exception_cancel();
@@ -141,14 +265,97 @@ static bool do_new(int argc, char *argv[])
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    size_t spread = buf_size - MIN_RANDSTR_LEN;
+    size_t len = MIN_RANDSTR_LEN + str_rng_next(&rand_rng) % spread;
+    str_fill_lower(&rand_rng, buf, len);
+    buf[len] = '\0';
+}
 
-    for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+/*
+ * Generate n random strings for a bulk insertion.
+ * The pointer array and the strings share one block, release it with free.
+ * Return NULL if could not allocate space.
+ */
+static char **alloc_rand_strings(int n)
+{
+    char **strs = malloc(n * (sizeof(char *) + MAX_RANDSTR_LEN));
+    if (!strs)
+        return NULL;
+
+    char *buf = (char *) (strs + n);
+    for (int i = 0; i < n; i++) {
+        strs[i] = buf + i * MAX_RANDSTR_LEN;
+        fill_rand_string(strs[i], MAX_RANDSTR_LEN);
     }
-    buf[len] = '\0';
+    return strs;
+}
+
+/*
+ * String k places from the head or the tail of the queue, NULL if the
+ * queue is shorter.  Linked queues are walked, so k should be small.
+ */
+static const char *queue_end_value(bool tail, size_t k)
+{
+    if (k >= lcnt)
+        return NULL;
+    if (q_is_ring(l_meta.l))
+        return q_ring_entry(l_meta.l, tail ? lcnt - 1 - k : k)->value;
+    if (q_is_compact(l_meta.l))
+        return q_compact_value(l_meta.l, tail ? lcnt - 1 - k : k);
+
+    struct list_head *cur = tail ? l_meta.l->prev : l_meta.l->next;
+    while (k--)
+        cur = tail ? cur->prev : cur->next;
+    return list_entry(cur, element_t, list)->value;
+}
+
+/* Name of the kind of h if it keeps its elements off the list, or NULL */
+static const char *unlinked_kind(struct list_head *h)
+{
+    if (q_is_ring(h))
+        return "ring";
+    if (q_is_compact(h))
+        return "compact";
+    return NULL;
+}
+
+/* Report operations which need linked elements on a ring or compact queue */
+static bool unlinked_unsupported(const char *cmd)
+{
+    const char *kind = unlinked_kind(l_meta.l);
+    if (!kind)
+        return false;
+    report(1, "ERROR: %s is not supported by %s queues", cmd, kind);
+    return true;
+}
+
+/*
+ * Check the two outermost elements after a bulk insertion.
+ * end is the element inserted last, next is its neighbour further inside,
+ * or NULL if there is none.
+ */
+static bool check_bulk_insert(const char *end,
+                              const char *next,
+                              const char *last_string)
+{
+    const char *cur_inserts = end;
+    if (!cur_inserts) {
+        report(1, "ERROR: Failed to save copy of string in queue");
+        return false;
+    }
+    if (cur_inserts == last_string) {
+        report(1,
+               "ERROR: Need to allocate and copy string for new queue "
+               "element");
+        return false;
+    }
+    if (cur_inserts == next) {
+        report(1,
+               "ERROR: Need to allocate separate string for each queue "
+               "element");
+        return false;
+    }
+    return true;
 }
 
 /* insert head */
@@ -168,7 +375,7 @@ static bool do_ih(int argc, char *argv[])
         return ok;
     }
 
-    char *lasts = NULL;
+    const char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
@@ -194,16 +401,33 @@ static bool do_ih(int argc, char *argv[])
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    /* Random strings are inserted with one bulk call when possible */
+    char **rand_strs = NULL;
+    if (need_rand && reps > 1)
+        rand_strs = alloc_rand_strings(reps);
+
     if (exception_setup(true)) {
+        int64_t t = stats_begin();
+        if (rand_strs && q_insert_head_bulk(l_meta.l, rand_strs, reps)) {
+            stats_end(STAT_IH_BULK, t);
+            lcnt += reps;
+            l_meta.size += reps;
+            ok = check_bulk_insert(queue_end_value(false, 0),
+                                   queue_end_value(false, 1),
+                                   rand_strs[reps - 1]) &&
+                 !error_check();
+            reps = 0;
+        }
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            t = stats_begin();
             bool rval = q_insert_head(l_meta.l, inserts);
+            stats_end(STAT_IH, t);
             if (rval) {
                 lcnt++;
                 l_meta.size++;
-                char *cur_inserts =
-                    list_entry(l_meta.l->next, element_t, list)->value;
+                const char *cur_inserts = queue_end_value(false, 0);
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -236,6 +460,7 @@ static bool do_ih(int argc, char *argv[])
         }
     }
     exception_cancel();
+    free(rand_strs);
 
     show_queue(3);
     return ok;
@@ -283,16 +508,33 @@ static bool do_it(int argc, char *argv[])
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    /* Random strings are inserted with one bulk call when possible */
+    char **rand_strs = NULL;
+    if (need_rand && reps > 1)
+        rand_strs = alloc_rand_strings(reps);
+
     if (exception_setup(true)) {
+        int64_t t = stats_begin();
+        if (rand_strs && q_insert_tail_bulk(l_meta.l, rand_strs, reps)) {
+            stats_end(STAT_IT_BULK, t);
+            lcnt += reps;
+            l_meta.size += reps;
+            ok = check_bulk_insert(queue_end_value(true, 0),
+                                   queue_end_value(true, 1),
+                                   rand_strs[reps - 1]) &&
+                 !error_check();
+            reps = 0;
+        }
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            t = stats_begin();
             bool rval = q_insert_tail(l_meta.l, inserts);
+            stats_end(STAT_IT, t);
             if (rval) {
                 lcnt++;
                 l_meta.size++;
-                char *cur_inserts =
-                    list_entry(l_meta.l->prev, element_t, list)->value;
+                const char *cur_inserts = queue_end_value(true, 0);
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -312,6 +554,8 @@ static bool do_it(int argc, char *argv[])
         }
     }
     exception_cancel();
+    free(rand_strs);
+
     show_queue(3);
     return ok;
 }
@@ -376,9 +620,12 @@ static bool do_remove(int option, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
         re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
                     : q_remove_head(l_meta.l, removes, string_length + 1);
+        stats_end(option ? STAT_RT : STAT_RH, t);
+    }
     exception_cancel();
 
     bool is_null = re ? false : true;
@@ -460,8 +707,11 @@ static bool do_rhq(int argc, char *argv[])
 
     element_t *re = NULL;
 
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
         re = q_remove_head(l_meta.l, NULL, 0);
+        stats_end(STAT_RH, t);
+    }
     exception_cancel();
 
     if (re) {
@@ -486,12 +736,170 @@ static bool do_rhq(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* remove n elements from head at once, without copying their strings */
+static bool do_rhn(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int n;
+    if (!get_int(argv[1], &n) || n < 0) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
+        return false;
+    }
+
+    bool ok = true;
+    if (!l_meta.size)
+        report(3, "Warning: Calling remove head on empty queue");
+    error_check();
+
+    struct list_head removed;
+    INIT_LIST_HEAD(&removed);
+    size_t cnt = 0;
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
+        cnt = q_remove_head_n(l_meta.l, n, &removed);
+        stats_end(STAT_RHN, t);
+    }
+    exception_cancel();
+
+    size_t expect = (size_t) n < lcnt ? (size_t) n : lcnt;
+    if (cnt != expect) {
+        report(1, "ERROR: Removed %lu elements, but expected %lu", cnt,
+               expect);
+        ok = false;
+    }
+
+    /* q_remove_head_n is not responsible for releasing nodes */
+    size_t released = 0;
+    element_t *item, *safe;
+    list_for_each_entry_safe (item, safe, &removed, list) {
+        q_release_element(item);
+        released++;
+    }
+    if (released != cnt) {
+        report(1, "ERROR: Reported %lu removed elements, but detached %lu",
+               cnt, released);
+        ok = false;
+    }
+
+    report(2, "Removed %lu elements from queue", released);
+    lcnt -= released;
+    l_meta.size -= released;
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static int value_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void free_values(char **values, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        free(values[i]);
+    free(values);
+}
+
+/*
+ * Dedup with q_delete_dup_unsorted() and check that exactly the strings
+ * which occurred once are left, in their original order.
+ */
+static bool dedup_unsorted()
+{
+    size_t n = l_meta.l ? (size_t) q_size(l_meta.l) : 0;
+    char **values = malloc((n ? n : 1) * sizeof(char *));
+    char **sorted = malloc((n ? n : 1) * sizeof(char *));
+    if (!values || !sorted) {
+        report(
+            1,
+            "INTERNAL ERROR.  Could not allocate space for duplicate checking");
+        free(values);
+        free(sorted);
+        return false;
+    }
+    size_t k = 0;
+    element_t *item;
+    if (l_meta.l) {
+        list_for_each_entry (item, l_meta.l, list) {
+            if (!(values[k] = strdup(item->value))) {
+                report(1,
+                       "INTERNAL ERROR.  Could not allocate space for "
+                       "duplicate checking");
+                free_values(values, k);
+                free(sorted);
+                return false;
+            }
+            sorted[k] = values[k];
+            k++;
+        }
+    }
+    qsort(sorted, n, sizeof(char *), value_cmp);
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
+        ok = q_delete_dup_unsorted(l_meta.l);
+        stats_end(STAT_DEDUP, t);
+    }
+    exception_cancel();
+    if (!ok) {
+        report(1, l_meta.l ? "ERROR: Could not delete duplicates"
+                           : "ERROR: Calling delete duplicate on null queue");
+        free_values(values, n);
+        free(sorted);
+        return false;
+    }
+
+    /* Walk the survivors alongside the strings that occurred once */
+    struct list_head *cur = l_meta.l->next;
+    size_t left = 0;
+    for (size_t i = 0; ok && i < n; i++) {
+        char **at = bsearch(&values[i], sorted, n, sizeof(char *), value_cmp);
+        bool dup = (at > sorted && !strcmp(at[-1], values[i])) ||
+                   (at < sorted + n - 1 && !strcmp(at[1], values[i]));
+        if (dup)
+            continue;
+        left++;
+        if (cur == l_meta.l ||
+            strcmp(list_entry(cur, element_t, list)->value, values[i])) {
+            report(1, "ERROR: Expected \"%s\" next after removing duplicates",
+                   values[i]);
+            ok = false;
+            break;
+        }
+        cur = cur->next;
+    }
+    if (ok && cur != l_meta.l) {
+        report(1, "ERROR: Duplicate string remain on queue");
+        ok = false;
+    }
+    free_values(values, n);
+    free(sorted);
+
+    if (ok) {
+        lcnt = left;
+        l_meta.size = left;
+    }
+    show_queue(3);
+    return ok && !error_check();
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    bool unsorted = argc == 2 && !strcmp(argv[1], "unsorted");
+    if (argc != 1 && !unsorted) {
+        report(1, "%s takes no arguments but 'unsorted'", argv[0]);
         return false;
     }
+    if (unlinked_unsupported(argv[0]))
+        return false;
+    if (unsorted)
+        return dedup_unsorted();
 
     // establish checking list dup_value
     struct list_head *dup_value = malloc(sizeof(*dup_value));
@@ -513,7 +921,7 @@ static bool do_dedup(int argc, char *argv[])
             next_item = list_entry(item->list.next, element_t, list);
 
             // assume queue has been sorted
-            bool match = !strcmp(item->value, next_item->value);
+            bool match = strcmp(item->value, next_item->value) == 0;
             if (match && !last_dup) {
                 int n = strlen(item->value) + 1;
                 char *str = malloc(sizeof(*str) * n);
@@ -566,8 +974,11 @@ static bool do_dedup(int argc, char *argv[])
         }
     }
     bool ok = true;
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
         ok = q_delete_dup(l_meta.l);
+        stats_end(STAT_DEDUP, t);
+    }
     exception_cancel();
 
     if (!ok) {
@@ -626,25 +1037,169 @@ static bool do_dedup(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/*
+ * Record the elements of the current queue in order, so that a
+ * rearrangement can be checked afterwards: their list nodes, or the
+ * strings of a compact queue, whose nodes stay in place while relinked.
+ * Set *np to their number.
+ * Return NULL if the queue is empty or could not allocate space.
+ */
+static const void **queue_snapshot(size_t *np)
+{
+    *np = l_meta.l ? (size_t) q_size(l_meta.l) : 0;
+    if (!*np)
+        return NULL;
+    const void **snap = malloc(*np * sizeof(void *));
+    if (!snap) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for checking");
+        return NULL;
+    }
+    if (q_is_compact(l_meta.l)) {
+        for (size_t i = 0; i < *np; i++)
+            snap[i] = q_compact_value(l_meta.l, i);
+        return snap;
+    }
+    size_t i = 0;
+    struct list_head *cur;
+    list_for_each (cur, l_meta.l) {
+        if (i == *np)
+            break;
+        snap[i++] = cur;
+    }
+    return snap;
+}
+
+/*
+ * Check that position i of the queue holds snap[pos(i)], with every prev
+ * link matching, and release snap.  pos(i) is given for groups of k.
+ */
+static bool check_rearranged(const void **snap,
+                             size_t n,
+                             size_t (*pos)(size_t i, size_t n, size_t k),
+                             size_t k,
+                             const char *op)
+{
+    if (!l_meta.l)
+        return true;
+
+    bool ok = true;
+    if (q_is_compact(l_meta.l)) {
+        for (size_t i = 0; ok && snap && i < n; i++) {
+            if (q_compact_value(l_meta.l, i) != snap[pos(i, n, k)]) {
+                report(1, "ERROR: Element %zu is misplaced after %s", i, op);
+                ok = false;
+            }
+        }
+        free(snap);
+        return ok;
+    }
+
+    struct list_head *cur = l_meta.l;
+    for (size_t i = 0; ok && snap && i < n; i++) {
+        struct list_head *next = cur->next;
+        if (next == l_meta.l || next->prev != cur ||
+            next != snap[pos(i, n, k)]) {
+            report(1, "ERROR: Element %zu is misplaced after %s", i, op);
+            ok = false;
+        }
+        cur = next;
+    }
+    if (ok && (cur->next != l_meta.l || l_meta.l->prev != cur)) {
+        report(1, "ERROR: Queue is not doubly circular after %s", op);
+        ok = false;
+    }
+    free(snap);
+    return ok;
+}
+
+static size_t reverse_pos(size_t i, size_t n, size_t k)
+{
+    return n - 1 - i;
+}
+
+static size_t reverse_k_pos(size_t i, size_t n, size_t k)
+{
+    if (i >= n / k * k)
+        return i;
+    return i / k * k + (k - 1 - i % k);
+}
+
+static size_t swap_k_pos(size_t i, size_t n, size_t k)
+{
+    if (i >= n / (2 * k) * 2 * k)
+        return i;
+    size_t o = i % (2 * k);
+    return i - o + (o < k ? o + k : o - k);
+}
+
 static bool do_reverse(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
+    /* Compact queues relink their nodes in place */
+    if (!q_is_compact(l_meta.l) && unlinked_unsupported(argv[0]))
+        return false;
 
     if (!l_meta.l)
         report(3, "Warning: Calling reverse on null queue");
     error_check();
 
+    size_t n;
+    const void **snap = queue_snapshot(&n);
+    if (n && !snap)
+        return false;
+
     set_noallocate_mode(true);
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
         q_reverse(l_meta.l);
+        stats_end(STAT_REVERSE, t);
+    }
     exception_cancel();
 
     set_noallocate_mode(false);
+    bool ok = check_rearranged(snap, n, reverse_pos, 1, argv[0]);
     show_queue(3);
-    return !error_check();
+    return ok && !error_check();
+}
+
+static bool do_reverseK(int argc, char *argv[])
+{
+    int k;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &k) || k < 1) {
+        report(1, "Invalid group size '%s'", argv[1]);
+        return false;
+    }
+    if (unlinked_unsupported(argv[0]))
+        return false;
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling reverseK on null queue");
+    error_check();
+
+    size_t n;
+    const void **snap = queue_snapshot(&n);
+    if (n && !snap)
+        return false;
+
+    set_noallocate_mode(true);
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
+        q_reverseK(l_meta.l, k);
+        stats_end(STAT_REVERSEK, t);
+    }
+    exception_cancel();
+
+    set_noallocate_mode(false);
+    bool ok = check_rearranged(snap, n, reverse_k_pos, k, argv[0]);
+    show_queue(3);
+    return ok && !error_check();
 }
 
 static bool do_size(int argc, char *argv[])
@@ -674,7 +1229,9 @@ static bool do_size(int argc, char *argv[])
 
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
+            int64_t t = stats_begin();
             cnt = q_size(l_meta.l);
+            stats_end(STAT_SIZE, t);
             ok = ok && !error_check();
         }
     }
@@ -696,12 +1253,26 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Sort with the algorithm selected by sortalgo and threads */
+static void sort_queue(q_sortkey_t *keys)
+{
+    if (keys)
+        q_sort_keys(l_meta.l, keys);
+    else if (sort_threads > 1)
+        q_sort_parallel(l_meta.l, sort_threads);
+    else
+        q_sort(l_meta.l);
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
+    /* Compact queues relink their nodes in place */
+    if (!q_is_compact(l_meta.l) && unlinked_unsupported(argv[0]))
+        return false;
 
     if (!l_meta.l)
         report(3, "Warning: Calling sort on null queue");
@@ -712,14 +1283,39 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
+    /* Scratch space for the key array sort is set up outside the queue */
+    q_sortkey_t *keys = NULL;
+    if (sort_algo == 1 && cnt > 1) {
+        keys = malloc(sizeof(q_sortkey_t) * cnt);
+        if (!keys) {
+            report(1, "INTERNAL ERROR.  Could not allocate space for sorting");
+            return false;
+        }
+    }
+
     set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_sort(l_meta.l);
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
+        sort_queue(keys);
+        stats_end(STAT_SORT, t);
+    }
     exception_cancel();
     set_noallocate_mode(false);
+    free(keys);
 
     bool ok = true;
-    if (l_meta.size) {
+    if (l_meta.size && q_is_compact(l_meta.l)) {
+        const char *prev = q_compact_value(l_meta.l, 0);
+        for (int i = 1; i < cnt; i++) {
+            const char *value = q_compact_value(l_meta.l, i);
+            if (strcmp(prev, value) > 0) {
+                report(1, "ERROR: Not sorted in ascending order");
+                ok = false;
+                break;
+            }
+            prev = value;
+        }
+    } else if (l_meta.size) {
         for (struct list_head *cur_l = l_meta.l->next;
              cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
@@ -727,7 +1323,7 @@ bool do_sort(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (strcasecmp(item->value, next_item->value) > 0) {
+            if (strcmp(item->value, next_item->value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
@@ -745,125 +1341,1626 @@ static bool do_dm(int argc, char *argv[])
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
+    if (unlinked_unsupported(argv[0]))
+        return false;
 
     if (!l_meta.l)
         report(3, "Warning: Try to access null queue");
     error_check();
 
     bool ok = true;
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
         ok = q_delete_mid(l_meta.l);
+        stats_end(STAT_DM, t);
+    }
+    exception_cancel();
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_swap(int argc, char *argv[])
+{
+    int k = 1;
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 2 && (!get_int(argv[1], &k) || k < 1)) {
+        report(1, "Invalid group size '%s'", argv[1]);
+        return false;
+    }
+    if (unlinked_unsupported(argv[0]))
+        return false;
+
+    if (!l_meta.l)
+        report(3, "Warning: Try to access null queue");
+    error_check();
+
+    size_t n;
+    const void **snap = queue_snapshot(&n);
+    if (n && !snap)
+        return false;
+
+    set_noallocate_mode(true);
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
+        if (argc == 1)
+            q_swap(l_meta.l);
+        else
+            q_swapK(l_meta.l, k);
+        stats_end(STAT_SWAP, t);
+    }
+    exception_cancel();
+
+    set_noallocate_mode(false);
+    bool ok = check_rearranged(snap, n, swap_k_pos, k, argv[0]);
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* create another queue and select it */
+static bool do_add(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 2 && queue_kind(argv[1]) < 0) {
+        report(1, "Unknown queue type '%s'", argv[1]);
+        return false;
+    }
+
+    int id = free_slot();
+    if (id < 0) {
+        report(1, "ERROR: All %d queues are in use", MAX_QUEUES);
+        return false;
+    }
+    select_queue(id);
+    report(2, "Selected queue %d", id);
+    return do_new(argc, argv);
+}
+
+static bool do_select(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int id;
+    if (!get_int(argv[1], &id) || id < 0 || id >= MAX_QUEUES) {
+        report(1, "Invalid queue number '%s'", argv[1]);
+        return false;
+    }
+    select_queue(id);
+    show_queue(3);
+    return true;
+}
+
+static bool do_queues(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    queues[cur_queue] = l_meta;
+    for (int i = 0; i < MAX_QUEUES; i++) {
+        const list_head_meta_t *m = &queues[i];
+        char mark = i == cur_queue ? '*' : ' ';
+        if (!m->l) {
+            if (i == cur_queue)
+                report(1, "%c %2d: NULL", mark, i);
+            continue;
+        }
+        const char *kind = unlinked_kind(m->l);
+        report(1, "%c %2d: %d elements%s%s%s", mark, i, m->size,
+               kind ? " (" : "", kind ? kind : "", kind ? ")" : "");
+    }
+    return true;
+}
+
+/*
+ * Bytes the C library adds to each block it hands out, for its header and
+ * rounding, on average for the small blocks queues are made of.
+ */
+#define MALLOC_OVERHEAD 16
+
+/*
+ * Report the heap taken by the queues, per element.  This is the footprint
+ * and not the bytes the elements use: the ring slots and compact arena
+ * chunks allocated ahead are counted in full, so a compact queue of a few
+ * elements shows its whole first chunk of 32 KB.
+ */
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    queues[cur_queue] = l_meta;
+    size_t elements = 0;
+    for (int i = 0; i < MAX_QUEUES; i++) {
+        if (queues[i].l)
+            elements += queues[i].size;
+    }
+    size_t blocks = allocation_check();
+    size_t bytes = allocation_bytes();
+
+    report(1, "%lu elements, %lu blocks of %lu bytes in total", elements,
+           blocks, bytes);
+    if (elements) {
+        report(1,
+               "%.1f bytes per element, about %.1f with malloc overhead "
+               "(%.2f blocks per element)",
+               (double) bytes / elements,
+               (double) (bytes + blocks * MALLOC_OVERHEAD) / elements,
+               (double) blocks / elements);
+    }
+    return true;
+}
+
+/* merge the other queues, or those given, into the selected one */
+static bool do_merge(int argc, char *argv[])
+{
+    struct list_head *heads[MAX_QUEUES];
+    int ids[MAX_QUEUES];
+    int k = 0;
+
+    if (argc > MAX_QUEUES) {
+        report(1, "%s takes at most %d arguments", argv[0], MAX_QUEUES - 1);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling merge on null queue");
+        return false;
+    }
+
+    ids[k] = cur_queue;
+    heads[k++] = l_meta.l;
+    for (int i = 0; argc == 1 && i < MAX_QUEUES; i++) {
+        if (i != cur_queue && queues[i].l) {
+            ids[k] = i;
+            heads[k++] = queues[i].l;
+        }
+    }
+    for (int a = 1; a < argc; a++) {
+        int id;
+        if (get_int(argv[a], &id) && id == cur_queue)
+            continue; /* The selected queue is merged anyway */
+        bool valid = get_int(argv[a], &id) && id >= 0 && id < MAX_QUEUES &&
+                     queues[id].l;
+        for (int j = 0; valid && j < k; j++)
+            valid = ids[j] != id;
+        if (!valid) {
+            report(1, "Invalid queue number '%s'", argv[a]);
+            return false;
+        }
+        ids[k] = id;
+        heads[k++] = queues[id].l;
+    }
+
+    size_t total = lcnt;
+    size_t moved[MAX_QUEUES];
+    for (int j = 0; j < k; j++) {
+        const char *kind = unlinked_kind(heads[j]);
+        if (kind) {
+            report(1, "ERROR: %s is not supported by %s queues", argv[0],
+                   kind);
+            return false;
+        }
+        if (j) {
+            total += queues[ids[j]].size;
+            moved[j] = element_blocks(heads[j]);
+        }
+    }
+
+    bool ok = false;
+    set_noallocate_mode(true);
+    if (exception_setup(true)) {
+        int64_t t = stats_begin();
+        ok = q_merge(heads, k);
+        stats_end(STAT_MERGE, t);
+    }
     exception_cancel();
+    set_noallocate_mode(false);
+
+    if (!ok) {
+        report(1, "ERROR: Could not merge queues");
+        return false;
+    }
+    /*
+     * The elements the other queues held are in the selected one now, which
+     * takes over their blocks once another queue gets selected.
+     */
+    for (int j = 1; j < k; j++) {
+        list_head_meta_t *m = &queues[ids[j]];
+        m->size = 0;
+        m->blocks -= moved[j] < m->blocks ? moved[j] : m->blocks;
+    }
+    lcnt = total;
+    l_meta.size = total;
+    report(2, "Merged %d queues into queue %d", k, cur_queue);
+
+    int cnt = q_size(l_meta.l);
+    if (cnt != (int) total) {
+        report(1, "ERROR: Merged queue has %d elements, but expected %d", cnt,
+               (int) total);
+        ok = false;
+    }
+    for (struct list_head *cur = l_meta.l->next;
+         ok && cur != l_meta.l && cur->next != l_meta.l; cur = cur->next) {
+        element_t *item = list_entry(cur, element_t, list);
+        element_t *next_item = list_entry(cur->next, element_t, list);
+        if (strcmp(item->value, next_item->value) > 0) {
+            report(1, "ERROR: Not sorted in ascending order");
+            ok = false;
+        }
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* split the selected queue into k, using free slots for the new ones */
+static bool do_split(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int k;
+    if (!get_int(argv[1], &k) || k < 1 || k > MAX_QUEUES) {
+        report(1, "Invalid number of queues '%s'", argv[1]);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling split on null queue");
+        return false;
+    }
+    if (unlinked_unsupported(argv[0]))
+        return false;
+
+    int ids[MAX_QUEUES];
+    int n = 0;
+    for (int i = 0; i < MAX_QUEUES && n < k - 1; i++) {
+        if (i != cur_queue && !queues[i].l)
+            ids[n++] = i;
+    }
+    if (n < k - 1) {
+        report(1, "ERROR: Only %d queues are free", n);
+        return false;
+    }
+
+    struct list_head *parts[MAX_QUEUES];
+    int made = 0;
+    bool ok = false;
+    size_t before = allocation_check();
+    if (exception_setup(true)) {
+        while (made < k - 1 && (parts[made] = q_new()))
+            made++;
+        if (made == k - 1) {
+            set_noallocate_mode(true);
+            int64_t t = stats_begin();
+            ok = q_split(l_meta.l, parts, k);
+            stats_end(STAT_SPLIT, t);
+        }
+    }
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    if (!ok) {
+        for (int j = 0; j < made; j++)
+            q_free(parts[j]);
+        report(1, "ERROR: Could not split queue");
+        return false;
+    }
+
+    /* Blocks of the head each part was created with */
+    size_t header_blocks = k > 1 ? (allocation_check() - before) / (k - 1) : 0;
+
+    /* Share j of total elements, share 0 being the one kept */
+    size_t total = lcnt;
+    for (int j = 0; j < k; j++) {
+        list_head_meta_t *m = j ? &queues[ids[j - 1]] : &l_meta;
+        /* Parts hold their own blocks, the kept queue the rest */
+        if (j) {
+            m->l = parts[j - 1];
+            m->blocks = header_blocks + element_blocks(m->l);
+        }
+        m->size = q_size(m->l);
+        int expect = total / k + ((size_t) j < total % k);
+        if (ok && m->size != expect) {
+            report(1, "ERROR: Part %d has %d elements, but expected %d", j,
+                   m->size, expect);
+            ok = false;
+        }
+    }
+    lcnt = l_meta.size;
+
+    report_noreturn(2, "Split queue %d into", cur_queue);
+    report_noreturn(2, " %d", cur_queue);
+    for (int j = 0; j < k - 1; j++)
+        report_noreturn(2, " %d", ids[j]);
+    report(2, "");
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool is_circular()
+{
+    struct list_head *cur = l_meta.l->next;
+    while (cur != l_meta.l) {
+        if (!cur)
+            return false;
+        cur = cur->next;
+    }
+
+    cur = l_meta.l->prev;
+    while (cur != l_meta.l) {
+        if (!cur)
+            return false;
+        cur = cur->prev;
+    }
+    return true;
+}
+
+static bool show_queue(int vlevel)
+{
+    bool ok = true;
+    if (verblevel < vlevel)
+        return true;
+
+    int cnt = 0;
+    if (!l_meta.l) {
+        report(vlevel, "l = NULL");
+        return true;
+    }
+
+    if (!is_circular()) {
+        report(vlevel, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    report_noreturn(vlevel, "l = [");
+
+    if (unlinked_kind(l_meta.l)) {
+        int size = q_size(l_meta.l);
+        for (; cnt < size && cnt < big_list_size; cnt++) {
+            const char *value = q_is_ring(l_meta.l)
+                                    ? q_ring_entry(l_meta.l, cnt)->value
+                                    : q_compact_value(l_meta.l, cnt);
+            report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", value);
+        }
+        report(vlevel, size <= big_list_size ? "]" : " ... ]");
+        if (size != lcnt) {
+            report(vlevel, "ERROR:  Queue has %d elements, expected %d", size,
+                   (int) lcnt);
+            ok = false;
+        }
+        return ok;
+    }
+
+    struct list_head *ori = l_meta.l;
+    struct list_head *cur = l_meta.l->next;
+
+    if (exception_setup(true)) {
+        while (ok && ori != cur && cnt < lcnt) {
+            element_t *e = list_entry(cur, element_t, list);
+            if (cnt < big_list_size)
+                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+            cnt++;
+            cur = cur->next;
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    if (!ok) {
+        report(vlevel, " ... ]");
+        return false;
+    }
+
+    if (cur == ori) {
+        if (cnt <= big_list_size)
+            report(vlevel, "]");
+        else
+            report(vlevel, " ... ]");
+    } else {
+        report(vlevel, " ... ]");
+        report(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
+        ok = false;
+    }
+
+    return ok;
+}
+
+static bool do_show(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    return show_queue(0);
+}
+
+/* latency histograms of the queue calls made so far */
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        stats_reset();
+        return true;
+    }
+
+    stats_format_t fmt = STATS_TEXT;
+    if (argc > 1) {
+        if (!strcmp(argv[1], "csv"))
+            fmt = STATS_CSV;
+        else if (!strcmp(argv[1], "json"))
+            fmt = STATS_JSON;
+        else {
+            report(1, "Unknown statistics format '%s'", argv[1]);
+            return false;
+        }
+    }
+
+    FILE *f = stdout;
+    if (argc == 3 && !(f = fopen(argv[2], "w"))) {
+        report(1, "Cannot create statistics file '%s'", argv[2]);
+        return false;
+    }
+    bool ok = stats_print(fmt, f);
+    if (f != stdout && fclose(f))
+        ok = false;
+    if (!ok)
+        report(1, "Error writing statistics");
+    return ok;
+}
+
+/*
+ * Compiled traces
+ *
+ * compile turns a command file into a flat array of operations, so replay
+ * can drive the queue without any parsing.  A compiled trace holds a header,
+ * the operation records, the offsets into the string table and the table
+ * itself.  Each string keeps its terminator and is used in place from the
+ * mapped file.  Random strings are not stored, they are generated again from
+ * the seed in the header.  Commands without an operation code are kept as
+ * text and handed to the interpreter.
+ */
+#define TRACE_MAGIC "lab0trc1"
+#define TRACE_NOSTR UINT32_MAX      /* No string operand */
+#define TRACE_RAND (UINT32_MAX - 1) /* Random string operand */
+#define TRACE_MAX_DEPTH 8           /* Nesting limit of source commands */
+#define TRACE_LINE_MAX 8192
+
+enum {
+    TOP_NEW,
+    TOP_FREE,
+    TOP_IH,
+    TOP_IT,
+    TOP_RH,
+    TOP_RT,
+    TOP_RHQ,
+    TOP_RHN,
+    TOP_REVERSE,
+    TOP_SORT,
+    TOP_SWAP,
+    TOP_DM,
+    TOP_DEDUP,
+    TOP_SIZE,
+    TOP_CMD,
+    TOP_COUNT,
+};
+
+/* Commands with an operation code, and the number of arguments they take */
+static const struct {
+    const char *name;
+    int min_args, max_args;
+} trace_cmds[TOP_CMD] = {
+    [TOP_NEW] = {"new", 0, 1},         [TOP_FREE] = {"free", 0, 0},
+    [TOP_IH] = {"ih", 1, 2},           [TOP_IT] = {"it", 1, 2},
+    [TOP_RH] = {"rh", 0, 1},           [TOP_RT] = {"rt", 0, 1},
+    [TOP_RHQ] = {"rhq", 0, 0},         [TOP_RHN] = {"rhn", 1, 1},
+    [TOP_REVERSE] = {"reverse", 0, 0}, [TOP_SORT] = {"sort", 0, 0},
+    [TOP_SWAP] = {"swap", 0, 0},       [TOP_DM] = {"dm", 0, 0},
+    [TOP_DEDUP] = {"dedup", 0, 0},     [TOP_SIZE] = {"size", 0, 1},
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t seed;
+    uint32_t nops;
+    uint32_t nstrs;
+    uint32_t strbytes;
+} trace_header_t;
+
+typedef struct {
+    uint32_t op;
+    uint32_t arg; /* Repetitions, element count or queue backend */
+    uint32_t str; /* Index into string table */
+} trace_op_t;
+
+typedef struct {
+    trace_op_t *ops;
+    uint32_t nops, ops_cap;
+    uint32_t *offs;
+    uint32_t nstrs, offs_cap;
+    char *strs;
+    uint32_t strbytes, strs_cap;
+    /* Hash set of string indices plus one, 0 marks an empty slot */
+    uint32_t *slots;
+    uint32_t slots_cap;
+    /* Commands are compiled as text while simulation is enabled */
+    bool simulation;
+    bool quit;
+} trace_builder_t;
+
+static bool trace_grow(void **p, uint32_t *cap, uint32_t need, size_t size)
+{
+    if (need <= *cap)
+        return true;
+
+    uint32_t ncap = *cap ? *cap : 64;
+    while (ncap < need)
+        ncap *= 2;
+    void *np = realloc(*p, (size_t) ncap * size);
+    if (!np)
+        return false;
+    *p = np;
+    *cap = ncap;
+    return true;
+}
+
+/* FNV-1a */
+static uint32_t trace_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) s[i]) * 16777619u;
+    return h;
+}
+
+static bool trace_rehash(trace_builder_t *b)
+{
+    uint32_t cap = b->slots_cap ? b->slots_cap * 2 : 256;
+    uint32_t *slots = calloc(cap, sizeof(uint32_t));
+    if (!slots)
+        return false;
+
+    for (uint32_t i = 0; i < b->nstrs; i++) {
+        const char *s = b->strs + b->offs[i];
+        uint32_t h = trace_hash(s, strlen(s)) & (cap - 1);
+        while (slots[h])
+            h = (h + 1) & (cap - 1);
+        slots[h] = i + 1;
+    }
+    free(b->slots);
+    b->slots = slots;
+    b->slots_cap = cap;
+    return true;
+}
+
+/*
+ * Return the index of the len bytes at s in the string table, adding them
+ * when they are new.  Return TRACE_NOSTR if could not allocate space.
+ */
+static uint32_t trace_intern(trace_builder_t *b, const char *s, size_t len)
+{
+    if (2 * (b->nstrs + 1) > b->slots_cap && !trace_rehash(b))
+        return TRACE_NOSTR;
+
+    uint32_t mask = b->slots_cap - 1;
+    uint32_t h = trace_hash(s, len) & mask;
+    for (; b->slots[h]; h = (h + 1) & mask) {
+        const char *t = b->strs + b->offs[b->slots[h] - 1];
+        if (!strncmp(t, s, len) && t[len] == '\0')
+            return b->slots[h] - 1;
+    }
+
+    if (!trace_grow((void **) &b->offs, &b->offs_cap, b->nstrs + 1,
+                    sizeof(uint32_t)) ||
+        !trace_grow((void **) &b->strs, &b->strs_cap, b->strbytes + len + 1,
+                    1))
+        return TRACE_NOSTR;
+
+    memcpy(b->strs + b->strbytes, s, len);
+    b->strs[b->strbytes + len] = '\0';
+    b->offs[b->nstrs] = b->strbytes;
+    b->strbytes += len + 1;
+    b->slots[h] = ++b->nstrs;
+    return b->nstrs - 1;
+}
+
+static bool trace_emit(trace_builder_t *b, uint32_t op, uint32_t arg,
+                       uint32_t str)
+{
+    if (!trace_grow((void **) &b->ops, &b->ops_cap, b->nops + 1,
+                    sizeof(trace_op_t))) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for trace");
+        return false;
+    }
+    b->ops[b->nops++] = (trace_op_t){.op = op, .arg = arg, .str = str};
+    return true;
+}
+
+/* Find the operation code of a command, or TOP_CMD to keep it as text */
+static uint32_t trace_lookup(int argc, char *argv[], uint32_t *argp)
+{
+    uint32_t op;
+    for (op = 0; op < TOP_CMD; op++) {
+        if (!strcmp(argv[0], trace_cmds[op].name))
+            break;
+    }
+    if (op == TOP_CMD || argc - 1 < trace_cmds[op].min_args ||
+        argc - 1 > trace_cmds[op].max_args)
+        return TOP_CMD;
+
+    /* The backend of a new queue is kept in the operation */
+    if (op == TOP_NEW) {
+        int kind = argc == 2 ? queue_kind(argv[1]) : QUEUE_LIST;
+        if (kind < 0)
+            return TOP_CMD;
+        *argp = kind;
+        return op;
+    }
+
+    /* Counts that the command would reject are left to the interpreter */
+    int n = 1;
+    char *count = NULL;
+    if (op == TOP_IH || op == TOP_IT)
+        count = argc == 3 ? argv[2] : NULL;
+    else if (op == TOP_RHN || op == TOP_SIZE)
+        count = argc == 2 ? argv[1] : NULL;
+    if (count && (!get_int(count, &n) || n < 0))
+        return TOP_CMD;
+
+    *argp = n;
+    return op;
+}
+
+static bool trace_compile_file(trace_builder_t *b, char *name, int depth);
+
+static bool trace_compile_line(trace_builder_t *b,
+                               char *line,
+                               size_t len,
+                               int depth)
+{
+    char copy[TRACE_LINE_MAX];
+    char *argv[4], *save;
+    int argc = 0;
+
+    memcpy(copy, line, len + 1);
+    for (char *t = strtok_r(copy, " \t", &save); t;
+         t = strtok_r(NULL, " \t", &save)) {
+        if (argc < 4)
+            argv[argc] = t;
+        argc++;
+    }
+    if (argc == 0 || argv[0][0] == '#')
+        return true;
+
+    if (!strcmp(argv[0], "quit")) {
+        b->quit = true;
+        return true;
+    }
+    if (!strcmp(argv[0], "source") && argc == 2) {
+        if (depth >= TRACE_MAX_DEPTH) {
+            report(1, "Source files nested too deeply at '%s'", argv[1]);
+            return false;
+        }
+        return trace_compile_file(b, argv[1], depth + 1);
+    }
+    if (!strcmp(argv[0], "option") && argc >= 3 && argc <= 4 &&
+        !strcmp(argv[1], "simulation")) {
+        int value;
+        if (get_int(argv[2], &value))
+            b->simulation = value != 0;
+    }
+
+    uint32_t arg = 0, str = TRACE_NOSTR;
+    uint32_t op = b->simulation ? TOP_CMD : trace_lookup(argc, argv, &arg);
+    switch (op) {
+    case TOP_IH:
+    case TOP_IT:
+        if (!strcmp(argv[1], "RAND")) {
+            str = TRACE_RAND;
+            break;
+        }
+        /* fall through */
+    case TOP_RH:
+    case TOP_RT:
+        if (argc > 1 && (str = trace_intern(b, argv[1], strlen(argv[1]))) ==
+                            TRACE_NOSTR) {
+            report(1, "INTERNAL ERROR.  Could not allocate space for trace");
+            return false;
+        }
+        break;
+    case TOP_CMD:
+        if ((str = trace_intern(b, line, len)) == TRACE_NOSTR) {
+            report(1, "INTERNAL ERROR.  Could not allocate space for trace");
+            return false;
+        }
+        break;
+    }
+    return trace_emit(b, op, arg, str);
+}
+
+static bool trace_compile_file(trace_builder_t *b, char *name, int depth)
+{
+    FILE *f = fopen(name, "r");
+    if (!f) {
+        report(1, "Cannot open trace file '%s'", name);
+        return false;
+    }
+
+    char line[TRACE_LINE_MAX];
+    bool ok = true;
+    int lineno = 0;
+    while (ok && !b->quit && fgets(line, sizeof(line), f)) {
+        lineno++;
+        size_t len = strcspn(line, "\r\n");
+        if (len == sizeof(line) - 1) {
+            report(1, "Line %d of '%s' is too long", lineno, name);
+            ok = false;
+            break;
+        }
+        line[len] = '\0';
+        ok = trace_compile_line(b, line, len, depth);
+    }
+    if (ok && ferror(f)) {
+        report(1, "Error reading trace file '%s'", name);
+        ok = false;
+    }
+    fclose(f);
+    return ok;
+}
+
+static bool trace_write(const trace_builder_t *b, char *name, uint32_t seed)
+{
+    trace_header_t h = {
+        .seed = seed,
+        .nops = b->nops,
+        .nstrs = b->nstrs,
+        .strbytes = b->strbytes,
+    };
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+
+    FILE *f = fopen(name, "wb");
+    if (!f) {
+        report(1, "Cannot create compiled trace '%s'", name);
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(b->ops, sizeof(trace_op_t), b->nops, f) == b->nops &&
+              fwrite(b->offs, sizeof(uint32_t), b->nstrs, f) == b->nstrs &&
+              fwrite(b->strs, 1, b->strbytes, f) == b->strbytes;
+    if (fclose(f))
+        ok = false;
+    if (!ok)
+        report(1, "Error writing compiled trace '%s'", name);
+    return ok;
+}
+
+static bool do_compile(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        report(1, "%s needs 2-3 arguments", argv[0]);
+        return false;
+    }
+
+    int seed = (int) time(NULL);
+    if (argc == 4 && !get_int(argv[3], &seed)) {
+        report(1, "Invalid seed '%s'", argv[3]);
+        return false;
+    }
+
+    trace_builder_t b = {0};
+    bool ok = trace_compile_file(&b, argv[1], 0) &&
+              trace_write(&b, argv[2], (uint32_t) seed);
+    if (ok)
+        report(2, "Compiled %u operations and %u strings into %s", b.nops,
+               b.nstrs, argv[2]);
+
+    free(b.ops);
+    free(b.offs);
+    free(b.strs);
+    free(b.slots);
+    return ok;
+}
+
+/* Compiled trace being replayed */
+typedef struct {
+    const trace_op_t *ops;
+    const uint32_t *offs;
+    const char *strs;
+    uint32_t nops, nstrs;
+    /* Destination of removed strings, grows with option length */
+    char *removes;
+    size_t removes_size;
+} replay_t;
+
+/* Check a mapped trace of size bytes, and locate its sections */
+static bool replay_map(replay_t *rp, const void *map, size_t size)
+{
+    trace_header_t h;
+    if (size < sizeof(h))
+        return false;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) ||
+        size != sizeof(h) + (size_t) h.nops * sizeof(trace_op_t) +
+                    (size_t) h.nstrs * sizeof(uint32_t) + h.strbytes)
+        return false;
+
+    rp->ops = (const trace_op_t *) ((const char *) map + sizeof(h));
+    rp->offs = (const uint32_t *) (rp->ops + h.nops);
+    rp->strs = (const char *) (rp->offs + h.nstrs);
+    rp->nops = h.nops;
+    rp->nstrs = h.nstrs;
+
+    if (h.strbytes && rp->strs[h.strbytes - 1] != '\0')
+        return false;
+    for (uint32_t i = 0; i < h.nstrs; i++) {
+        if (rp->offs[i] >= h.strbytes)
+            return false;
+    }
+    for (uint32_t i = 0; i < h.nops; i++) {
+        const trace_op_t *op = &rp->ops[i];
+        bool has_str = op->str < h.nstrs;
+        if (op->op >= TOP_COUNT || (!has_str && op->str != TRACE_NOSTR &&
+                                    op->str != TRACE_RAND))
+            return false;
+        if ((op->op == TOP_CMD || op->op == TOP_IH || op->op == TOP_IT) &&
+            op->str == TRACE_NOSTR)
+            return false;
+        if (op->op == TOP_NEW && op->arg > QUEUE_COMPACT)
+            return false;
+    }
+
+    srand(h.seed);
+    str_rng_seed(&rand_rng, h.seed);
+    return true;
+}
+
+/* Count a failed operation the same way as the interactive commands */
+static bool replay_failed(const char *what)
+{
+    fail_count++;
+    if (fail_count < fail_limit)
+        return true;
+    report(1, "ERROR: %s failed (%d failures total)", what, fail_count);
+    return false;
+}
+
+/* Checkpoint: the queue must be circular and agree with the tracked size */
+static bool replay_check()
+{
+    if (!l_meta.l)
+        return true;
+    if (!is_circular()) {
+        report(1, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+    int cnt = q_size(l_meta.l);
+    if (cnt != l_meta.size) {
+        report(1, "ERROR: Computed queue size as %d, but correct value is %d",
+               cnt, l_meta.size);
+        return false;
+    }
+    return true;
+}
+
+static bool replay_free()
+{
+    q_free(l_meta.l);
+    l_meta.l = NULL;
+    l_meta.size = 0;
+    lcnt = 0;
+
+    size_t bcnt = leaked_blocks();
+    if (bcnt > 0) {
+        report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
+               bcnt);
+        return false;
+    }
+    return true;
+}
 
-    show_queue(3);
-    return ok && !error_check();
+/* A NULL str inserts random strings */
+static bool replay_insert(bool tail, const char *str, uint32_t reps)
+{
+    char randstr_buf[MAX_RANDSTR_LEN];
+    char *inserts = str ? (char *) str : randstr_buf;
+
+    if (!str && reps > 1) {
+        char **strs = alloc_rand_strings(reps);
+        bool ok = strs && (tail ? q_insert_tail_bulk(l_meta.l, strs, reps)
+                                : q_insert_head_bulk(l_meta.l, strs, reps));
+        free(strs);
+        if (ok) {
+            lcnt += reps;
+            l_meta.size += reps;
+            return true;
+        }
+    }
+
+    for (uint32_t r = 0; r < reps; r++) {
+        if (!str)
+            fill_rand_string(randstr_buf, sizeof(randstr_buf));
+        if (tail ? q_insert_tail(l_meta.l, inserts)
+                 : q_insert_head(l_meta.l, inserts)) {
+            lcnt++;
+            l_meta.size++;
+        } else if (!replay_failed("Insertion")) {
+            return false;
+        }
+    }
+    return true;
 }
 
-static bool do_swap(int argc, char *argv[])
+static bool replay_remove(replay_t *rp, uint32_t op, const char *expect)
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    char *sp = NULL;
+    size_t bufsize = 0;
+    if (op != TOP_RHQ) {
+        bufsize = string_length + 1;
+        if (bufsize > rp->removes_size) {
+            char *removes = realloc(rp->removes, bufsize);
+            if (!removes) {
+                report(1,
+                       "INTERNAL ERROR.  Could not allocate space for "
+                       "removed strings");
+                return false;
+            }
+            rp->removes = removes;
+            rp->removes_size = bufsize;
+        }
+        sp = rp->removes;
+        sp[0] = '\0';
+    }
+
+    element_t *re = op == TOP_RT ? q_remove_tail(l_meta.l, sp, bufsize)
+                                 : q_remove_head(l_meta.l, sp, bufsize);
+    if (!re) {
+        if (expect) {
+            report(1, "ERROR: Removal from queue failed");
+            return false;
+        }
+        return replay_failed("Removal from queue");
+    }
+    q_release_element(re);
+    lcnt--;
+    l_meta.size--;
+
+    if (expect && strncmp(sp, expect, string_length)) {
+        report(1, "ERROR: Removed value %s != expected value %s", sp, expect);
         return false;
     }
+    return true;
+}
 
-    if (!l_meta.l)
-        report(3, "Warning: Try to access null queue");
-    error_check();
+static bool replay_sort()
+{
+    q_sortkey_t *keys = NULL;
+    if (sort_algo == 1 && l_meta.size > 1) {
+        keys = malloc(sizeof(q_sortkey_t) * l_meta.size);
+        if (!keys) {
+            report(1, "INTERNAL ERROR.  Could not allocate space for sorting");
+            return false;
+        }
+    }
 
     set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_swap(l_meta.l);
-    exception_cancel();
-
+    sort_queue(keys);
     set_noallocate_mode(false);
+    free(keys);
+    return true;
+}
 
-    show_queue(3);
-    return !error_check();
+/* The number of elements removed by q_delete_dup is not known up front */
+static bool replay_recount()
+{
+    if (!l_meta.l)
+        return true;
+    if (!is_circular()) {
+        report(1, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    int cnt = 0;
+    struct list_head *cur;
+    list_for_each (cur, l_meta.l)
+        cnt++;
+    l_meta.size = cnt;
+    lcnt = cnt;
+    return true;
 }
 
-static bool is_circular()
+static bool replay_op(replay_t *rp, const trace_op_t *op)
 {
-    struct list_head *cur = l_meta.l->next;
-    while (cur != l_meta.l) {
-        if (!cur)
+    const char *str = op->str < rp->nstrs ? rp->strs + rp->offs[op->str]
+                                          : NULL;
+    switch (op->op) {
+    case TOP_REVERSE:
+    case TOP_SORT:
+        if (q_is_compact(l_meta.l))
+            break;
+        /* fall through */
+    case TOP_SWAP:
+    case TOP_DM:
+    case TOP_DEDUP:
+        if (unlinked_unsupported(trace_cmds[op->op].name))
             return false;
-        cur = cur->next;
+        break;
     }
 
-    cur = l_meta.l->prev;
-    while (cur != l_meta.l) {
-        if (!cur)
+    switch (op->op) {
+    case TOP_NEW:
+        if (l_meta.l && !replay_free())
             return false;
-        cur = cur->prev;
+        l_meta.l = queue_create(op->arg);
+        l_meta.size = 0;
+        lcnt = 0;
+        return true;
+    case TOP_FREE:
+        return replay_free();
+    case TOP_IH:
+    case TOP_IT:
+        return replay_insert(op->op == TOP_IT, str, op->arg);
+    case TOP_RH:
+    case TOP_RT:
+    case TOP_RHQ:
+        return replay_remove(rp, op->op, str);
+    case TOP_RHN: {
+        struct list_head removed;
+        INIT_LIST_HEAD(&removed);
+        size_t cnt = q_remove_head_n(l_meta.l, op->arg, &removed);
+        element_t *item, *safe;
+        list_for_each_entry_safe (item, safe, &removed, list)
+            q_release_element(item);
+        lcnt -= cnt;
+        l_meta.size -= cnt;
+        return true;
     }
-    return true;
+    case TOP_REVERSE:
+    case TOP_SWAP:
+        set_noallocate_mode(true);
+        if (op->op == TOP_REVERSE)
+            q_reverse(l_meta.l);
+        else
+            q_swap(l_meta.l);
+        set_noallocate_mode(false);
+        return true;
+    case TOP_SORT:
+        return replay_sort();
+    case TOP_DM:
+        if (q_delete_mid(l_meta.l)) {
+            lcnt--;
+            l_meta.size--;
+        }
+        return true;
+    case TOP_DEDUP:
+        q_delete_dup(l_meta.l);
+        return replay_recount();
+    case TOP_SIZE:
+        return replay_check();
+    }
+    return false;
 }
 
-static bool show_queue(int vlevel)
+/*
+ * Run the operations of a compiled trace.  Stretches of queue operations run
+ * under a single exception handler, which has to be released around each
+ * textual command because the interpreted command sets up its own.
+ */
+static bool replay_run(replay_t *rp)
 {
-    bool ok = true;
-    if (verblevel < vlevel)
-        return true;
+    volatile uint32_t i = 0;
+    volatile bool ok = true;
+
+    while (ok && i < rp->nops) {
+        const trace_op_t *op = &rp->ops[i];
+        if (op->op == TOP_CMD) {
+            const char *cmd = rp->strs + rp->offs[op->str];
+            ok = interpret_line(cmd, strlen(cmd));
+            i++;
+            continue;
+        }
 
-    int cnt = 0;
-    if (!l_meta.l) {
-        report(vlevel, "l = NULL");
-        return true;
+        if (exception_setup(false)) {
+            for (; ok && i < rp->nops && rp->ops[i].op != TOP_CMD; i++)
+                ok = replay_op(rp, &rp->ops[i]) && !error_check();
+        } else {
+            set_noallocate_mode(false);
+            ok = false;
+            i++;
+        }
+        exception_cancel();
     }
 
-    if (!is_circular()) {
-        report(vlevel, "ERROR:  Queue is not doubly circular");
+    /* i counts the failing operation from one */
+    ok = ok && replay_check();
+    if (!ok)
+        report(1, "ERROR: Replay stopped at operation %u", i);
+    return ok;
+}
+
+static bool do_replay(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
         return false;
     }
 
-    report_noreturn(vlevel, "l = [");
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        report(1, "Cannot open compiled trace '%s'", argv[1]);
+        return false;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    replay_t r = {0};
+    if (map == MAP_FAILED || !replay_map(&r, map, st.st_size)) {
+        report(1, "'%s' is not a valid compiled trace", argv[1]);
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        return false;
+    }
 
-    struct list_head *ori = l_meta.l;
-    struct list_head *cur = l_meta.l->next;
+    /* argv belongs to the interpreter, and textual commands overwrite it */
+    uint32_t nops = r.nops;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = replay_run(&r);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    if (ok)
+        report(2, "Replayed %u operations in %.3f seconds (%.0f ops/sec)",
+               nops, secs, secs > 0 ? nops / secs : 0.0);
+
+    free(r.removes);
+    munmap(map, st.st_size);
+    show_queue(3);
+    return ok;
+}
+
+/*
+ * Queue snapshots
+ *
+ * save writes the strings of the queue from head to tail, and load puts
+ * them back in place of the contents of the current queue, which keeps its
+ * backend.  A snapshot holds a header and then one
+ * record per string: its length as a 32-bit word, its bytes and its
+ * terminator.  The terminator lets load hand the strings to
+ * q_insert_tail_bulk() in place from the mapped file.
+ */
+#define SNAP_MAGIC "lab0snp1"
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    /* Bytes of records following the header */
+    uint64_t bytes;
+} snap_header_t;
+
+static bool snap_write(FILE *f, snap_header_t *h, const char *s, size_t len)
+{
+    uint32_t n = len;
+    if (len >= UINT32_MAX)
+        return false;
+    h->count++;
+    h->bytes += sizeof(n) + len + 1;
+    return fwrite(&n, sizeof(n), 1, f) == 1 &&
+           fwrite(s, 1, len + 1, f) == len + 1;
+}
+
+static bool do_save(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling save on null queue");
+        return false;
+    }
+    if (!unlinked_kind(l_meta.l) && !is_circular()) {
+        report(1, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    FILE *f = fopen(argv[1], "wb");
+    if (!f) {
+        report(1, "Cannot create snapshot '%s'", argv[1]);
+        return false;
+    }
 
+    /* The header is written again once the records are counted */
+    snap_header_t h = {0};
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < lcnt) {
-            element_t *e = list_entry(cur, element_t, list);
-            if (cnt < big_list_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-            cnt++;
-            cur = cur->next;
-            ok = ok && !error_check();
+        int size = q_size(l_meta.l);
+        if (q_is_ring(l_meta.l)) {
+            for (int i = 0; ok && i < size; i++) {
+                element_t *e = q_ring_entry(l_meta.l, i);
+                ok = snap_write(f, &h, e->value, strlen(e->value));
+            }
+        } else if (q_is_compact(l_meta.l)) {
+            for (int i = 0; ok && i < size; i++) {
+                const char *value = q_compact_value(l_meta.l, i);
+                ok = snap_write(f, &h, value, strlen(value));
+            }
+        } else {
+            element_t *e;
+            list_for_each_entry (e, l_meta.l, list) {
+                if (!ok)
+                    break;
+                ok = snap_write(f, &h, e->value, strlen(e->value));
+            }
         }
+    } else {
+        ok = false;
     }
     exception_cancel();
 
+    ok = ok && !fseek(f, 0, SEEK_SET) && fwrite(&h, sizeof(h), 1, f) == 1;
+    if (fclose(f))
+        ok = false;
     if (!ok) {
-        report(vlevel, " ... ]");
+        report(1, "Error writing snapshot '%s'", argv[1]);
         return false;
     }
+    report(2, "Saved %lu elements to '%s'", (unsigned long) h.count,
+           argv[1]);
+    return !error_check();
+}
 
-    if (cur == ori) {
-        if (cnt <= big_list_size)
-            report(vlevel, "]");
+/*
+ * Check the snapshot mapped at map and point strs at its strings.
+ * Return the number of strings, or -1 if the snapshot is not valid or
+ * could not allocate space.
+ */
+static long snap_map(const void *map, size_t size, char ***strsp)
+{
+    snap_header_t h;
+    if (size < sizeof(h))
+        return -1;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) ||
+        h.bytes != size - sizeof(h) || h.count > h.bytes / 5 ||
+        h.count > INT_MAX)
+        return -1;
+
+    /* One slot more, so that an empty snapshot gets a block as well */
+    char **strs = malloc((h.count + 1) * sizeof(char *));
+    if (!strs)
+        return -1;
+    char *p = (char *) map + sizeof(h), *end = p + h.bytes;
+    for (uint64_t i = 0; i < h.count; i++) {
+        uint32_t len;
+        if ((size_t) (end - p) < sizeof(len))
+            break;
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if ((size_t) (end - p) <= len || p[len] != '\0')
+            break;
+        strs[i] = p;
+        p += len + 1;
+    }
+    if (p != end) {
+        free(strs);
+        return -1;
+    }
+    *strsp = strs;
+    return h.count;
+}
+
+/* Create an empty queue with the same backend as h */
+static struct list_head *queue_like(struct list_head *h)
+{
+    if (q_is_ring(h))
+        return q_new_ring();
+    if (q_is_compact(h))
+        return q_new_compact();
+    return q_header(h)->pool ? q_new_pool() : q_new();
+}
+
+static bool do_load(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling load on null queue");
+        return false;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        report(1, "Cannot open snapshot '%s'", argv[1]);
+        return false;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    char **strs = NULL;
+    long n = -1;
+    if (map != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        n = snap_map(map, st.st_size, &strs);
+    }
+    if (n < 0) {
+        report(1, "'%s' is not a valid snapshot", argv[1]);
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        return false;
+    }
+
+    /*
+     * The strings are only read, the mapping stays read-only.  They go to a
+     * new queue, which replaces the current one once all are in, so that
+     * the current queue is left as it was if loading fails.
+     */
+    struct list_head *l = NULL;
+    bool ok = false;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (exception_setup(true)) {
+        l = queue_like(l_meta.l);
+        int64_t t = stats_begin();
+        ok = l && q_insert_tail_bulk(l, strs, n);
+        stats_end(STAT_IT_BULK, t);
+    }
+    exception_cancel();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(strs);
+    munmap(map, st.st_size);
+
+    if (!ok) {
+        q_free(l);
+        report(1, "ERROR: Could not load snapshot '%s'", argv[1]);
+        return false;
+    }
+    q_free(l_meta.l);
+    l_meta.l = l;
+    lcnt = n;
+    l_meta.size = n;
+
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    report(2, "Loaded %ld elements in %.3f seconds", n, secs);
+    show_queue(3);
+    return !error_check();
+}
+
+/* Threads the concurrent queue stress test may start */
+#define MPMC_MAX_THREADS 64
+
+/* Elements each producer pushes by default */
+#define MPMC_ELEMENTS 10000
+
+typedef struct {
+    mpmc_t *q;
+    /* Producer number, strings pushed are "id:seq" */
+    int id;
+    int n;
+    /* Elements popped by all consumers, and the number to stop at */
+    atomic_long *popped;
+    long total;
+    /* A consumer saw the elements of some producer out of order */
+    bool disorder;
+    /* Pushes repeated because an allocation failed */
+    long retries;
+    pthread_t tid;
+} mpmc_worker_t;
+
+static void *mpmc_producer(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    mpmc_handle_t *h = mpmc_attach(w->q);
+    char buf[32];
+    for (int seq = 0; seq < w->n; seq++) {
+        snprintf(buf, sizeof(buf), "%d:%d", w->id, seq);
+        while (!mpmc_push(h, buf))
+            w->retries++;
+    }
+    mpmc_detach(h);
+    return NULL;
+}
+
+/* Pop until every element is taken, checking FIFO order per producer */
+static void *mpmc_consumer(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    mpmc_handle_t *h = mpmc_attach(w->q);
+    long last[MPMC_MAX_THREADS];
+    for (int i = 0; i < MPMC_MAX_THREADS; i++)
+        last[i] = -1;
+
+    char buf[32];
+    while (atomic_load(w->popped) < w->total) {
+        if (!mpmc_pop(h, buf, sizeof(buf))) {
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_add(w->popped, 1);
+        char *colon;
+        long id = strtol(buf, &colon, 10);
+        long seq = strtol(colon + 1, NULL, 10);
+        if (id < 0 || id >= MPMC_MAX_THREADS || seq <= last[id])
+            w->disorder = true;
         else
-            report(vlevel, " ... ]");
-    } else {
-        report(vlevel, " ... ]");
-        report(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
+            last[id] = seq;
+    }
+    mpmc_detach(h);
+    return NULL;
+}
+
+/*
+ * Run np producers pushing n elements each against nc consumers.
+ * Set *ops to pushes plus pops per second.
+ */
+static bool mpmc_run(int np, int nc, int n, double *ops)
+{
+    mpmc_worker_t workers[MPMC_MAX_THREADS];
+    atomic_long popped = 0;
+    mpmc_t *q = mpmc_new(np + nc);
+    if (!q) {
+        report(1, "ERROR: Could not allocate concurrent queue");
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = true;
+    int started = 0;
+    for (; started < np + nc; started++) {
+        mpmc_worker_t *w = &workers[started];
+        bool producer = started < np;
+        *w = (mpmc_worker_t){.q = q,
+                             .id = started,
+                             .n = n,
+                             .popped = &popped,
+                             .total = (long) np * n};
+        if (pthread_create(&w->tid, NULL,
+                           producer ? mpmc_producer : mpmc_consumer, w)) {
+            report(1, "ERROR: Could not start thread %d", started);
+            ok = false;
+            break;
+        }
+    }
+    /* Without all producers, consumers would wait forever */
+    if (!ok)
+        atomic_store(&popped, (long) np * n);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].tid, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long retries = 0;
+    for (int i = 0; ok && i < np + nc; i++) {
+        retries += workers[i].retries;
+        if (workers[i].disorder) {
+            report(1, "ERROR: Consumer %d saw elements out of order", i - np);
+            ok = false;
+        }
+    }
+    if (ok && atomic_load(&popped) != (long) np * n) {
+        report(1, "ERROR: Popped %ld elements, but pushed %ld",
+               atomic_load(&popped), (long) np * n);
         ok = false;
     }
+    if (retries)
+        report(2, "%ld pushes repeated after failed allocations", retries);
+    mpmc_free(q);
 
+    double secs =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    *ops = secs > 0 ? 2.0 * np * n / secs : 0;
     return ok;
 }
 
-static bool do_show(int argc, char *argv[])
+/*
+ * Stress the concurrent queue with up to P producers and C consumers.
+ * Thread counts grow step by step in the ratio P:C, and every step reports
+ * its throughput and speedup over the first.
+ */
+static bool do_mpmc(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 3 && argc != 4) {
+        report(1, "%s needs 2-3 arguments", argv[0]);
         return false;
     }
-    return show_queue(0);
+
+    int np, nc, n = MPMC_ELEMENTS;
+    if (!get_int(argv[1], &np) || !get_int(argv[2], &nc) || np < 1 ||
+        nc < 1 || np + nc > MPMC_MAX_THREADS) {
+        report(1, "Need 1 or more producers and consumers, at most %d threads",
+               MPMC_MAX_THREADS);
+        return false;
+    }
+    if (argc == 4 && (!get_int(argv[3], &n) || n < 1)) {
+        report(1, "Invalid number of elements '%s'", argv[3]);
+        return false;
+    }
+
+    size_t blocks = allocation_check();
+    bool ok = true;
+    double base = 0;
+    int steps = np > nc ? np : nc;
+    report(1, "%9s %9s %14s %8s", "producers", "consumers", "ops/sec",
+           "speedup");
+    set_threadsafe_mode(true);
+    for (int i = 1; ok && i <= steps; i++) {
+        int p = (i * np + steps - 1) / steps;
+        int c = (i * nc + steps - 1) / steps;
+        double ops;
+        ok = mpmc_run(p, c, n, &ops);
+        if (i == 1)
+            base = ops;
+        if (ok)
+            report(1, "%9d %9d %14.0f %7.2fx", p, c, ops,
+                   base > 0 ? ops / base : 0.0);
+    }
+    set_threadsafe_mode(false);
+
+    if (allocation_check() != blocks) {
+        report(1, "ERROR: %ld blocks still allocated by the concurrent queue",
+               (long) (allocation_check() - blocks));
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+/*
+ * Seed the C library generator, which the harness draws allocation
+ * failures from, the random strings and randombytes() from random_seed.
+ * A seed of 0 takes a fresh one from the time and the kernel.
+ */
+static void seed_changed(int oldval)
+{
+    unsigned int seed =
+        random_seed ? (unsigned int) random_seed : (unsigned int) time(NULL);
+    srand(seed);
+    str_rng_seed(&rand_rng, seed);
+    randombytes_seed((unsigned int) random_seed);
+}
+
+/* Open the counter group on demand, or stay with plain timing */
+static void pmu_changed(int oldval)
+{
+    if (pmu_enabled && !oldval)
+        pmu_open();
+    else if (!pmu_enabled && oldval)
+        pmu_close();
 }
 
 static void console_init()
 {
-    ADD_COMMAND(new, "                | Create new queue");
+    ADD_COMMAND(new,
+                " [ring|compact] | Create new queue, kept in a ring buffer "
+                "with 'ring' or in index linked arena nodes with 'compact'");
     ADD_COMMAND(free, "                | Delete queue");
     ADD_COMMAND(
         ih,
@@ -884,22 +2981,80 @@ static void console_init()
     ADD_COMMAND(
         rhq,
         "                | Remove from head of queue without reporting value.");
+    ADD_COMMAND(
+        rhn,
+        " n              | Remove n elements from head of queue at once "
+        "without copying their strings.");
     ADD_COMMAND(reverse, "                | Reverse queue");
     ADD_COMMAND(sort, "                | Sort queue in ascending order");
     ADD_COMMAND(
         size, " [n]            | Compute queue size n times (default: n == 1)");
     ADD_COMMAND(show, "                | Show queue contents");
     ADD_COMMAND(dm, "                | Delete middle node in queue");
-    ADD_COMMAND(
-        dedup, "                | Delete all nodes that have duplicate string");
+    ADD_COMMAND(dedup,
+                " [unsorted]     | Delete all nodes that have duplicate "
+                "string, in a sorted queue unless unsorted");
     ADD_COMMAND(swap,
-                "                | Swap every two adjacent nodes in queue");
+                " [k]            | Swap every two adjacent groups of k nodes "
+                "in queue (default: k == 1)");
+    ADD_COMMAND(reverseK, " k              | Reverse the nodes of the queue "
+                          "k at a time");
+    ADD_COMMAND(add,
+                " [ring|compact] | Create another queue like new and select "
+                "it, keeping the current one");
+    ADD_COMMAND(select, " n              | Select queue n");
+    ADD_COMMAND(mem,
+                "                | Show heap footprint and blocks per element "
+                "of the queues, room allocated ahead included");
+    ADD_COMMAND(queues, "                | List the queues and their sizes");
+    ADD_COMMAND(merge,
+                " [n ...]        | Merge sorted queues n, or all other queues, "
+                "into the selected one");
+    ADD_COMMAND(split,
+                " k              | Split the selected queue into k queues of "
+                "consecutive elements");
+    ADD_COMMAND(mpmc,
+                " P C [n]        | Stress the lock-free queue with up to P "
+                "producers pushing n elements each and C consumers");
+    ADD_COMMAND(compile,
+                " in out [seed]  | Compile command file in into binary trace "
+                "out.  Random strings are generated from seed");
+    ADD_COMMAND(replay,
+                " file           | Run the operations of binary trace file");
+    ADD_COMMAND(save, " file           | Write the queue to snapshot file");
+    ADD_COMMAND(load,
+                " file           | Replace the contents of the queue with "
+                "snapshot file");
+    ADD_COMMAND(stats,
+                " [csv|json [f]] | Show latency percentiles in cycles of each "
+                "queue operation, optionally as CSV or JSON to file f.  "
+                "'stats reset' drops the samples");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("fill", &fill_policy,
+              "Malloc/free fill (0: whole payload, 1: first and last cache "
+              "lines, 2: none)",
+              NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("pool", &use_pool, "Allocate elements of new queues from slabs",
+              NULL);
+    add_param("sortalgo", &sort_algo,
+              "Sorting algorithm (0: linked list merge, 1: key array)", NULL);
+    add_param("threads", &sort_threads,
+              "Number of threads used by linked list sort", NULL);
+    add_param("workers", &dudect_workers,
+              "Number of threads running constant time measurements", NULL);
+    add_param("pmu", &pmu_enabled,
+              "Count instructions, cache and branch misses of queue "
+              "operations",
+              pmu_changed);
+    add_param("seed", &random_seed,
+              "Seed of random strings, allocation failures and constant "
+              "time inputs (0: fresh seed)",
+              seed_changed);
 }
 
 /* Signal handlers */
@@ -930,13 +3085,20 @@ static void queue_init()
 static bool queue_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
-
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
+    l_meta.l = NULL;
+
+    for (int i = 0; i < MAX_QUEUES; i++) {
+        if (!queues[i].l || i == cur_queue)
+            continue;
+        report(3, "Freeing queue %d", i);
+        if (exception_setup(true))
+            q_free(queues[i].l);
+        exception_cancel();
+        queues[i].l = NULL;
+    }
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -998,6 +3160,13 @@ int main(int argc, char *argv[])
     if (!sanity_check())
         return -1;
 
+    /* The string kernels picked for this CPU must match the scalar ones */
+    if (!str_check()) {
+        fprintf(stderr, "FATAL: %s string kernels disagree with scalar ones.\n",
+                str_kernels());
+        return -1;
+    }
+
     /* To hold input file name */
     char buf[BUFSIZE];
     char *infile_name = NULL;
@@ -1038,7 +3207,7 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
+    seed_changed(0);
     queue_init();
     init_cmd();
     console_init();
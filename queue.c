@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,17 +14,717 @@
  *   cppcheck-suppress nullPointer
  */
 
+/* Number of nodes carved from each slab */
+#define POOL_SLAB_NODES 1024
+
+/* Strings up to this size, including the terminator, are stored inline */
+#define INLINE_SIZE 16
+
+/* Slots a ring queue starts out with, a power of two */
+#define RING_MIN_SLOTS 16
+
+/* Nodes in each chunk of a compact queue, a power of two */
+#define COMPACT_CHUNK_BITS 10
+#define COMPACT_CHUNK_NODES (1u << COMPACT_CHUNK_BITS)
+
+/* Strings up to this size, including the terminator, fit in a compact node */
+#define COMPACT_INLINE 20
+
+/*
+ * Storage behind every element_t handed out by the queue.
+ * Short strings live in buf right after the list links and e.value points
+ * there, longer ones are allocated separately.  Pooled nodes always
+ * reserve INLINE_SIZE bytes of buf, nodes allocated on their own are sized
+ * to fit the string.
+ */
+typedef struct {
+    /* Pool the node was carved from, NULL when allocated on its own */
+    struct q_pool *pool;
+    element_t e;
+    char buf[];
+} qnode_t;
+
+#define POOL_NODE_SIZE                                          \
+    ((sizeof(qnode_t) + INLINE_SIZE + sizeof(void *) - 1) & \
+     ~(sizeof(void *) - 1))
+
+typedef struct q_slab {
+    struct q_slab *next;
+    unsigned char nodes[];
+} q_slab_t;
+
+struct q_pool {
+    q_slab_t *slabs;
+    /* Released nodes, chained through e.list.next */
+    struct list_head *free_nodes;
+    /* Nodes not yet carved from the newest slab */
+    size_t avail;
+    /* Nodes handed out and not released yet */
+    size_t live;
+    /* Live nodes whose string is allocated outside of the slab */
+    size_t heaped;
+    /* Owning queue has been freed, drop slabs once live reaches zero */
+    bool orphan;
+};
+
+static void pool_destroy(struct q_pool *pool)
+{
+    q_slab_t *slab = pool->slabs;
+    while (slab) {
+        q_slab_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    free(pool);
+}
+
+static qnode_t *pool_get(struct q_pool *pool)
+{
+    qnode_t *n;
+    if (pool->free_nodes) {
+        n = container_of(pool->free_nodes, qnode_t, e.list);
+        pool->free_nodes = pool->free_nodes->next;
+    } else {
+        if (!pool->avail) {
+            q_slab_t *slab =
+                malloc(sizeof(q_slab_t) + POOL_SLAB_NODES * POOL_NODE_SIZE);
+            if (!slab) {
+                return NULL;
+            }
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            pool->avail = POOL_SLAB_NODES;
+        }
+        pool->avail--;
+        n = (qnode_t *) (pool->slabs->nodes + pool->avail * POOL_NODE_SIZE);
+    }
+    n->pool = pool;
+    pool->live++;
+    return n;
+}
+
+static void pool_put(struct q_pool *pool, qnode_t *n)
+{
+    n->e.list.next = pool->free_nodes;
+    pool->free_nodes = &n->e.list;
+    if (!--pool->live && pool->orphan) {
+        pool_destroy(pool);
+    }
+}
+
+/* Multiply into 128 bits and fold the halves, the mixing step of wyhash */
+static inline uint64_t hash_mum(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/*
+ * Hash len bytes at s, eight at a time.
+ * This follows wyhash: each word is mixed with one of two secrets and all of
+ * them are folded into the state by multiplication.
+ */
+static uint64_t hash_string(const char *s, size_t len)
+{
+    const uint64_t s0 = 0xa0761d6478bd642full, s1 = 0xe7037ed1a0b428dbull;
+    uint64_t h = s0 ^ len, w;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, s + i, 8);
+        h = hash_mum(w ^ s1, h ^ s0);
+    }
+    w = 0;
+    memcpy(&w, s + i, len - i);
+    return hash_mum(w ^ s1, h ^ s1 ^ len);
+}
+
+/* Fill in the metadata of e from its string, len bytes long */
+static inline void element_meta(element_t *e, size_t len)
+{
+#ifdef ELEMENT_META
+    e->len = len;
+    e->hash = hash_string(e->value, len);
+    e->prefix = 0;
+    for (size_t i = 0; i < 8 && i < len; i++) {
+        e->prefix |= (uint64_t) (unsigned char) e->value[i] << (56 - 8 * i);
+    }
+#else
+    (void) e;
+    (void) len;
+#endif
+}
+
+/* Hash of the string of e */
+static inline uint64_t element_hash(const element_t *e)
+{
+#ifdef ELEMENT_META
+    return e->hash;
+#else
+    return hash_string(e->value, strlen(e->value));
+#endif
+}
+
+/*
+ * Length of the string of e, as far as copying it into bufsize bytes needs.
+ * Without a cached length, a long string is only scanned up to bufsize.
+ */
+static inline size_t element_copy_len(const element_t *e, size_t bufsize)
+{
+#ifdef ELEMENT_META
+    (void) bufsize;
+    return e->len;
+#else
+    return strnlen(e->value, bufsize - 1);
+#endif
+}
+
+/*
+ * Allocate an element holding a copy of s.
+ * Return NULL if could not allocate space.
+ */
+static element_t *element_new(queue_t *q, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    if (!q->pool) {
+        bool inlined = len <= INLINE_SIZE;
+        qnode_t *n = malloc(sizeof(qnode_t) + (inlined ? len : 0));
+        if (!n) {
+            return NULL;
+        }
+        if (inlined) {
+            n->e.value = memcpy(n->buf, s, len);
+        } else {
+            n->e.value = strdup(s);
+            if (!n->e.value) {
+                free(n);
+                return NULL;
+            }
+        }
+        n->pool = NULL;
+        element_meta(&n->e, len - 1);
+        return &n->e;
+    }
+
+    qnode_t *n = pool_get(q->pool);
+    if (!n) {
+        return NULL;
+    }
+    if (len <= INLINE_SIZE) {
+        n->e.value = memcpy(n->buf, s, len);
+    } else {
+        n->e.value = strdup(s);
+        if (!n->e.value) {
+            pool_put(q->pool, n);
+            return NULL;
+        }
+        q->pool->heaped++;
+    }
+    element_meta(&n->e, len - 1);
+    return &n->e;
+}
+
+/*
+ * Element handles of a ring queue.  The number of slots is a power of two,
+ * and the element at position i from the head is in
+ * slots[(first + i) & mask].
+ */
+struct q_ring {
+    size_t first;
+    size_t mask;
+    element_t *slots[];
+};
+
+static struct q_ring *ring_alloc(size_t nslots)
+{
+    struct q_ring *r =
+        malloc(sizeof(struct q_ring) + nslots * sizeof(element_t *));
+    if (!r) {
+        return NULL;
+    }
+    r->first = 0;
+    r->mask = nslots - 1;
+    return r;
+}
+
+/*
+ * Make room for one more element, doubling the ring when it is full.
+ * Each doubling copies all handles, which the inserts since the previous
+ * one pay for, so inserting stays constant time when amortized.
+ */
+static bool ring_reserve(queue_t *q)
+{
+    struct q_ring *r = q->ring;
+    if ((size_t) q->size <= r->mask) {
+        return true;
+    }
+    struct q_ring *bigger = ring_alloc(2 * (r->mask + 1));
+    if (!bigger) {
+        return false;
+    }
+    /* Unwrap the full ring to the start of the new one */
+    size_t wrap = r->mask + 1 - r->first;
+    memcpy(bigger->slots, r->slots + r->first, wrap * sizeof(element_t *));
+    memcpy(bigger->slots + wrap, r->slots, r->first * sizeof(element_t *));
+    free(r);
+    q->ring = bigger;
+    return true;
+}
+
+static bool ring_insert(queue_t *q, const char *s, bool tail)
+{
+    if (!ring_reserve(q)) {
+        return false;
+    }
+    element_t *e = element_new(q, s);
+    if (!e) {
+        return false;
+    }
+    INIT_LIST_HEAD(&e->list);
+
+    struct q_ring *r = q->ring;
+    if (tail) {
+        r->slots[(r->first + q->size) & r->mask] = e;
+    } else {
+        r->first = (r->first - 1) & r->mask;
+        r->slots[r->first] = e;
+    }
+    q->size++;
+    return true;
+}
+
+/* Take the element off one end of a ring queue which is not empty */
+static element_t *ring_remove(queue_t *q, bool tail)
+{
+    struct q_ring *r = q->ring;
+    element_t *e;
+    q->size--;
+    if (tail) {
+        e = r->slots[(r->first + q->size) & r->mask];
+    } else {
+        e = r->slots[r->first];
+        r->first = (r->first + 1) & r->mask;
+    }
+    return e;
+}
+
+/* Insert n elements one by one, taking them out again on failure */
+static bool ring_insert_bulk(queue_t *q, char **strs, size_t n, bool tail)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (!ring_insert(q, strs[i], tail)) {
+            while (i--) {
+                q_release_element(ring_remove(q, tail));
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Node of a compact queue, 32 bytes.  Nodes link to each other by their
+ * index in the arena, node 0 being the sentinel.  buf holds short strings
+ * and a pointer to the separately allocated copy of longer ones.
+ */
+typedef struct {
+    uint32_t next, prev;
+    /* String length, terminator not counted */
+    uint32_t len;
+    char buf[COMPACT_INLINE];
+} cnode_t;
+
+/*
+ * Arena of a compact queue.  Nodes are carved from chunks which never
+ * move, so that growing the arena only copies the table of chunks and
+ * wastes at most one partly used chunk.
+ */
+struct q_compact {
+    cnode_t **chunks;
+    /* Chunks allocated, and room in the table of chunks */
+    uint32_t nchunks, maxchunks;
+    /* Nodes carved from the chunks so far, the sentinel included */
+    uint32_t used;
+    /* Released nodes chained through next, 0 when there is none */
+    uint32_t free_nodes;
+    /*
+     * Node last read by q_compact_value() and its position, so that reading
+     * the strings in order steps one node at a time.  0 when unknown.
+     */
+    uint32_t cursor;
+    size_t cursor_pos;
+};
+
+static inline cnode_t *cnode(const struct q_compact *c, uint32_t i)
+{
+    return &c->chunks[i >> COMPACT_CHUNK_BITS][i & (COMPACT_CHUNK_NODES - 1)];
+}
+
+static inline char *cnode_value(cnode_t *n)
+{
+    if (n->len < COMPACT_INLINE) {
+        return n->buf;
+    }
+    char *s;
+    memcpy(&s, n->buf, sizeof(s));
+    return s;
+}
+
+static struct q_compact *compact_alloc()
+{
+    struct q_compact *c = malloc(sizeof(struct q_compact));
+    if (!c) {
+        return NULL;
+    }
+    c->maxchunks = 4;
+    c->chunks = malloc(c->maxchunks * sizeof(cnode_t *));
+    cnode_t *chunk = malloc(COMPACT_CHUNK_NODES * sizeof(cnode_t));
+    if (!c->chunks || !chunk) {
+        free(chunk);
+        free(c->chunks);
+        free(c);
+        return NULL;
+    }
+    c->chunks[0] = chunk;
+    c->nchunks = 1;
+    c->used = 1;
+    c->free_nodes = 0;
+    c->cursor = 0;
+    cnode(c, 0)->next = cnode(c, 0)->prev = 0;
+    return c;
+}
+
+/* Get a free node, return 0 if could not allocate space */
+static uint32_t compact_node(struct q_compact *c)
+{
+    uint32_t i = c->free_nodes;
+    if (i) {
+        c->free_nodes = cnode(c, i)->next;
+        return i;
+    }
+    if (c->used == c->nchunks * COMPACT_CHUNK_NODES) {
+        if (c->nchunks == UINT32_MAX >> COMPACT_CHUNK_BITS) {
+            return 0;
+        }
+        if (c->nchunks == c->maxchunks) {
+            cnode_t **chunks = malloc(2 * c->maxchunks * sizeof(cnode_t *));
+            if (!chunks) {
+                return 0;
+            }
+            memcpy(chunks, c->chunks, c->nchunks * sizeof(cnode_t *));
+            free(c->chunks);
+            c->chunks = chunks;
+            c->maxchunks *= 2;
+        }
+        cnode_t *chunk = malloc(COMPACT_CHUNK_NODES * sizeof(cnode_t));
+        if (!chunk) {
+            return 0;
+        }
+        c->chunks[c->nchunks++] = chunk;
+    }
+    return c->used++;
+}
+
+static bool compact_insert(queue_t *q, const char *s, bool tail)
+{
+    struct q_compact *c = q->compact;
+    size_t len = strlen(s);
+    if (len >= UINT32_MAX) {
+        return false;
+    }
+    char *copy = NULL;
+    if (len >= COMPACT_INLINE) {
+        copy = strdup(s);
+        if (!copy) {
+            return false;
+        }
+    }
+    uint32_t i = compact_node(c);
+    if (!i) {
+        free(copy);
+        return false;
+    }
+
+    cnode_t *n = cnode(c, i), *sentinel = cnode(c, 0);
+    n->len = len;
+    if (copy) {
+        memcpy(n->buf, &copy, sizeof(copy));
+    } else {
+        memcpy(n->buf, s, len + 1);
+    }
+    if (tail) {
+        n->next = 0;
+        n->prev = sentinel->prev;
+        cnode(c, n->prev)->next = i;
+        sentinel->prev = i;
+    } else {
+        n->prev = 0;
+        n->next = sentinel->next;
+        cnode(c, n->next)->prev = i;
+        sentinel->next = i;
+    }
+    c->cursor = 0;
+    q->size++;
+    return true;
+}
+
+/* Unlink node i of a compact queue and put it on the free chain */
+static void compact_unlink(queue_t *q, uint32_t i)
+{
+    struct q_compact *c = q->compact;
+    cnode_t *n = cnode(c, i);
+    cnode(c, n->prev)->next = n->next;
+    cnode(c, n->next)->prev = n->prev;
+    n->next = c->free_nodes;
+    c->free_nodes = i;
+    c->cursor = 0;
+    q->size--;
+}
+
+/* Drop the element off one end of a compact queue which is not empty */
+static void compact_drop(queue_t *q, bool tail)
+{
+    cnode_t *sentinel = cnode(q->compact, 0);
+    uint32_t i = tail ? sentinel->prev : sentinel->next;
+    cnode_t *n = cnode(q->compact, i);
+    if (n->len >= COMPACT_INLINE) {
+        free(cnode_value(n));
+    }
+    compact_unlink(q, i);
+}
+
+/*
+ * Take the element off one end of a compact queue which is not empty,
+ * handing it out as an element_t allocated on its own.  Long strings move
+ * over without a copy.
+ * Return NULL, leaving the queue unchanged, if could not allocate space.
+ */
+static element_t *compact_remove(queue_t *q, bool tail)
+{
+    cnode_t *sentinel = cnode(q->compact, 0);
+    uint32_t i = tail ? sentinel->prev : sentinel->next;
+    cnode_t *n = cnode(q->compact, i);
+    bool inlined = n->len < COMPACT_INLINE;
+    qnode_t *e = malloc(sizeof(qnode_t) + (inlined ? n->len + 1 : 0));
+    if (!e) {
+        return NULL;
+    }
+    e->pool = NULL;
+    e->e.value =
+        inlined ? memcpy(e->buf, n->buf, n->len + 1) : cnode_value(n);
+    element_meta(&e->e, n->len);
+    INIT_LIST_HEAD(&e->e.list);
+    compact_unlink(q, i);
+    return &e->e;
+}
+
+/* Insert n elements one by one, dropping them again on failure */
+static bool compact_insert_bulk(queue_t *q, char **strs, size_t n, bool tail)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (!compact_insert(q, strs[i], tail)) {
+            while (i--) {
+                compact_drop(q, tail);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Reverse a compact queue by exchanging next and prev of every node */
+static void compact_reverse(struct q_compact *c)
+{
+    uint32_t i = 0;
+    do {
+        cnode_t *n = cnode(c, i);
+        uint32_t next = n->next;
+        n->next = n->prev;
+        n->prev = next;
+        i = next;
+    } while (i);
+    c->cursor = 0;
+}
+
+/* Merge two sorted chains of nodes linked by next and ended by 0 */
+static uint32_t compact_merge(struct q_compact *c, uint32_t a, uint32_t b)
+{
+    uint32_t head = 0, *tail = &head;
+    while (a && b) {
+        cnode_t *na = cnode(c, a), *nb = cnode(c, b);
+        uint32_t *from = str_compare(cnode_value(na), na->len,
+                                     cnode_value(nb), nb->len) <= 0
+                             ? &a
+                             : &b;
+        *tail = *from;
+        tail = &cnode(c, *from)->next;
+        *from = *tail;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+/*
+ * Sort a compact queue bottom-up without allocating: chains of 2^k nodes
+ * are kept in bins[k] and merged as a binary counter carries, then the
+ * prev links are restored in one final pass.
+ */
+static void compact_sort(struct q_compact *c)
+{
+    uint32_t bins[32] = {0};
+    uint32_t i = cnode(c, 0)->next;
+    while (i) {
+        uint32_t chain = i;
+        i = cnode(c, i)->next;
+        cnode(c, chain)->next = 0;
+        int k = 0;
+        for (; bins[k]; k++) {
+            chain = compact_merge(c, bins[k], chain);
+            bins[k] = 0;
+        }
+        bins[k] = chain;
+    }
+    uint32_t sorted = 0;
+    for (int k = 0; k < 32; k++) {
+        if (bins[k]) {
+            sorted = compact_merge(c, bins[k], sorted);
+        }
+    }
+
+    uint32_t prev = 0;
+    cnode(c, 0)->next = sorted;
+    for (i = sorted; i; i = cnode(c, i)->next) {
+        cnode(c, i)->prev = prev;
+        prev = i;
+    }
+    cnode(c, 0)->prev = prev;
+    c->cursor = 0;
+}
+
+static void compact_destroy(struct q_compact *c)
+{
+    for (uint32_t i = cnode(c, 0)->next; i; i = cnode(c, i)->next) {
+        if (cnode(c, i)->len >= COMPACT_INLINE) {
+            free(cnode_value(cnode(c, i)));
+        }
+    }
+    for (uint32_t k = 0; k < c->nchunks; k++) {
+        free(c->chunks[k]);
+    }
+    free(c->chunks);
+    free(c);
+}
+
+static struct list_head *queue_new(bool pooled, bool ring, bool compact)
+{
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q) {
+        return NULL;
+    }
+    q->pool = NULL;
+    q->ring = NULL;
+    q->compact = NULL;
+    if (compact) {
+        q->compact = compact_alloc();
+        if (!q->compact) {
+            free(q);
+            return NULL;
+        }
+    }
+    if (ring) {
+        q->ring = ring_alloc(RING_MIN_SLOTS);
+        if (!q->ring) {
+            free(q);
+            return NULL;
+        }
+    }
+    if (pooled) {
+        q->pool = malloc(sizeof(struct q_pool));
+        if (!q->pool) {
+            free(q);
+            return NULL;
+        }
+        memset(q->pool, 0, sizeof(struct q_pool));
+    }
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    return &q->head;
+}
+
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
  */
 struct list_head *q_new()
 {
-    struct list_head *q = malloc(sizeof(struct list_head));
-    if (q) {
-        INIT_LIST_HEAD(q);
+    return queue_new(false, false, false);
+}
+
+/*
+ * Create empty queue whose elements are carved from slabs.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_pool()
+{
+    return queue_new(true, false, false);
+}
+
+/*
+ * Create empty queue keeping its elements in a ring buffer.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_ring()
+{
+    return queue_new(false, true, false);
+}
+
+/* Return element i from the head of a ring queue, NULL if out of range */
+element_t *q_ring_entry(struct list_head *head, size_t i)
+{
+    if (!head) {
+        return NULL;
+    }
+    queue_t *q = q_header(head);
+    if (!q->ring || i >= (size_t) q->size) {
+        return NULL;
     }
-    return q;
+    return q->ring->slots[(q->ring->first + i) & q->ring->mask];
+}
+
+/*
+ * Create empty queue keeping its strings in an arena of compact nodes.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_compact()
+{
+    return queue_new(false, false, true);
+}
+
+/* Return string i from the head of a compact queue, NULL if out of range */
+const char *q_compact_value(struct list_head *head, size_t i)
+{
+    if (!head) {
+        return NULL;
+    }
+    queue_t *q = q_header(head);
+    struct q_compact *c = q->compact;
+    if (!c || i >= (size_t) q->size) {
+        return NULL;
+    }
+    uint32_t node = 0;
+    if (c->cursor && i == c->cursor_pos + 1) {
+        node = cnode(c, c->cursor)->next;
+    } else if (i < (size_t) q->size / 2) {
+        for (size_t k = 0; k <= i; k++) {
+            node = cnode(c, node)->next;
+        }
+    } else {
+        for (size_t k = q->size - i; k > 0; k--) {
+            node = cnode(c, node)->prev;
+        }
+    }
+    c->cursor = node;
+    c->cursor_pos = i;
+    return cnode_value(cnode(c, node));
 }
 
 /* Free all storage used by queue */
@@ -30,12 +733,49 @@ void q_free(struct list_head *l)
     if (!l) {
         return;
     }
-    element_t *entry = NULL, *next = NULL;
-    list_for_each_entry_safe (entry, next, l, list) {
-        free(entry->value);
-        free(entry);
+    queue_t *q = q_header(l);
+    struct q_pool *pool = q->pool;
+    if (q->ring) {
+        while (q->size) {
+            q_release_element(ring_remove(q, false));
+        }
+        free(q->ring);
+        free(q);
+        return;
+    }
+    if (q->compact) {
+        compact_destroy(q->compact);
+        free(q);
+        return;
     }
-    free(l);
+    if (!pool) {
+        element_t *entry = NULL, *next = NULL;
+        list_for_each_entry_safe (entry, next, l, list) {
+            q_release_element(entry);
+        }
+        free(q);
+        return;
+    }
+
+    /* Nodes live in the slabs, only out-of-line strings need a walk */
+    if (pool->heaped) {
+        element_t *entry;
+        list_for_each_entry (entry, l, list) {
+            qnode_t *n = container_of(entry, qnode_t, e);
+            if (entry->value != n->buf) {
+                free(entry->value);
+                pool->heaped--;
+            }
+        }
+    }
+    pool->live -= q->size;
+    if (pool->live) {
+        /* Removed elements not yet released keep the slabs alive */
+        pool->orphan = true;
+    } else {
+        pool_destroy(pool);
+    }
+    free(q);
 }
 
 /*
@@ -50,16 +790,18 @@ bool q_insert_head(struct list_head *head, char *s)
     if (!head) {
         return false;
     }
-    element_t *e = malloc(sizeof(element_t));
-    if (!e) {
-        return false;
+    if (q_header(head)->ring) {
+        return ring_insert(q_header(head), s, false);
+    }
+    if (q_header(head)->compact) {
+        return compact_insert(q_header(head), s, false);
     }
-    e->value = strdup(s);
-    if (!e->value) {
-        free(e);
+    element_t *e = element_new(q_header(head), s);
+    if (!e) {
         return false;
     }
     list_add(&e->list, head);
+    q_header(head)->size++;
     return true;
 }
 
@@ -75,16 +817,97 @@ bool q_insert_tail(struct list_head *head, char *s)
     if (!head) {
         return false;
     }
-    element_t *e = malloc(sizeof(element_t));
+    if (q_header(head)->ring) {
+        return ring_insert(q_header(head), s, true);
+    }
+    if (q_header(head)->compact) {
+        return compact_insert(q_header(head), s, true);
+    }
+    element_t *e = element_new(q_header(head), s);
     if (!e) {
         return false;
     }
-    e->value = strdup(s);
-    if (!e->value) {
-        free(e);
+    list_add_tail(&e->list, head);
+    q_header(head)->size++;
+    return true;
+}
+
+/*
+ * Build elements for strs[0..n) into chain, each one either in front of or
+ * behind the previous one.  On failure the partial chain is released.
+ */
+static bool build_chain(queue_t *q,
+                        struct list_head *chain,
+                        char **strs,
+                        size_t n,
+                        bool reversed)
+{
+    INIT_LIST_HEAD(chain);
+    for (size_t i = 0; i < n; i++) {
+        element_t *e = element_new(q, strs[i]);
+        if (!e) {
+            element_t *entry, *safe;
+            list_for_each_entry_safe (entry, safe, chain, list) {
+                q_release_element(entry);
+            }
+            return false;
+        }
+        if (reversed) {
+            list_add(&e->list, chain);
+        } else {
+            list_add_tail(&e->list, chain);
+        }
+    }
+    return true;
+}
+
+/*
+ * Attempt to insert n elements at head of queue with a single splice.
+ * Return false, leaving the queue unchanged, if q is NULL or could not
+ * allocate space.
+ */
+bool q_insert_head_bulk(struct list_head *head, char **strs, size_t n)
+{
+    if (!head) {
         return false;
     }
-    list_add_tail(&e->list, head);
+    if (q_header(head)->ring) {
+        return ring_insert_bulk(q_header(head), strs, n, false);
+    }
+    if (q_header(head)->compact) {
+        return compact_insert_bulk(q_header(head), strs, n, false);
+    }
+    struct list_head chain;
+    if (!build_chain(q_header(head), &chain, strs, n, true)) {
+        return false;
+    }
+    list_splice(&chain, head);
+    q_header(head)->size += n;
+    return true;
+}
+
+/*
+ * Attempt to insert n elements at tail of queue with a single splice.
+ * Return false, leaving the queue unchanged, if q is NULL or could not
+ * allocate space.
+ */
+bool q_insert_tail_bulk(struct list_head *head, char **strs, size_t n)
+{
+    if (!head) {
+        return false;
+    }
+    if (q_header(head)->ring) {
+        return ring_insert_bulk(q_header(head), strs, n, true);
+    }
+    if (q_header(head)->compact) {
+        return compact_insert_bulk(q_header(head), strs, n, true);
+    }
+    struct list_head chain;
+    if (!build_chain(q_header(head), &chain, strs, n, false)) {
+        return false;
+    }
+    list_splice_tail(&chain, head);
+    q_header(head)->size += n;
     return true;
 }
 
@@ -104,15 +927,34 @@ bool q_insert_tail(struct list_head *head, char *s)
  */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head)) {
+    if (!head) {
         return NULL;
     }
-    element_t *e = list_first_entry(head, element_t, list);
+    element_t *e;
+    if (q_header(head)->ring) {
+        if (!q_header(head)->size) {
+            return NULL;
+        }
+        e = ring_remove(q_header(head), false);
+    } else if (q_header(head)->compact) {
+        if (!q_header(head)->size) {
+            return NULL;
+        }
+        e = compact_remove(q_header(head), false);
+        if (!e) {
+            return NULL;
+        }
+    } else {
+        if (list_empty(head)) {
+            return NULL;
+        }
+        e = list_first_entry(head, element_t, list);
+        list_del(&e->list);
+        q_header(head)->size--;
+    }
     if (sp) {
-        strncpy(sp, e->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
+        str_copy_out(sp, e->value, element_copy_len(e, bufsize), bufsize);
     }
-    list_del(&e->list);
     return e;
 }
 
@@ -122,43 +964,125 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head)) {
+    if (!head) {
         return NULL;
     }
-    element_t *e = list_last_entry(head, element_t, list);
-    if (sp) {
-        strncpy(sp, e->value, bufsize - 1);
-        sp[bufsize - 1] = '\0';
+    element_t *e;
+    if (q_header(head)->ring) {
+        if (!q_header(head)->size) {
+            return NULL;
+        }
+        e = ring_remove(q_header(head), true);
+    } else if (q_header(head)->compact) {
+        if (!q_header(head)->size) {
+            return NULL;
+        }
+        e = compact_remove(q_header(head), true);
+        if (!e) {
+            return NULL;
+        }
+    } else {
+        if (list_empty(head)) {
+            return NULL;
+        }
+        e = list_last_entry(head, element_t, list);
+        list_del(&e->list);
+        q_header(head)->size--;
+    }
+    if (sp) {
+        str_copy_out(sp, e->value, element_copy_len(e, bufsize), bufsize);
+    }
+    return e;
+}
+
+/*
+ * Attempt to remove the first n elements from head of queue at once.
+ * Return number of elements removed, 0 if q is NULL or empty.
+ */
+size_t q_remove_head_n(struct list_head *head,
+                       size_t n,
+                       struct list_head *out)
+{
+    INIT_LIST_HEAD(out);
+    if (!head || !n) {
+        return 0;
+    }
+    queue_t *q = q_header(head);
+    if (q->ring) {
+        if (n > (size_t) q->size) {
+            n = q->size;
+        }
+        for (size_t i = 0; i < n; i++) {
+            list_add_tail(&ring_remove(q, false)->list, out);
+        }
+        return n;
+    }
+    if (q->compact) {
+        size_t cnt = 0;
+        element_t *e;
+        while (cnt < n && q->size && (e = compact_remove(q, false))) {
+            list_add_tail(&e->list, out);
+            cnt++;
+        }
+        return cnt;
+    }
+    if (list_empty(head)) {
+        return 0;
+    }
+    if (n >= (size_t) q->size) {
+        n = q->size;
+        list_splice_init(head, out);
+    } else {
+        /* Walk from whichever end is closer to the cut */
+        struct list_head *node;
+        if (n <= (size_t) q->size / 2) {
+            node = head;
+            for (size_t i = 0; i < n; i++) {
+                node = node->next;
+            }
+        } else {
+            node = head->prev;
+            for (size_t i = q->size - n; i > 0; i--) {
+                node = node->prev;
+            }
+        }
+        list_cut_position(out, head, node);
     }
-    list_del(&e->list);
-    return e;
+    q->size -= n;
+    return n;
 }
 
 /*
- * WARN: This is for external usage, don't modify it
- * Attempt to release element.
+ * WARN: This is for external usage
+ * Attempt to release element, giving pooled nodes back to their slab.
  */
 void q_release_element(element_t *e)
 {
-    free(e->value);
-    free(e);
+    qnode_t *n = container_of(e, qnode_t, e);
+    struct q_pool *pool = n->pool;
+    if (e->value != n->buf) {
+        free(e->value);
+        if (pool) {
+            pool->heaped--;
+        }
+    }
+    if (pool) {
+        pool_put(pool, n);
+    } else {
+        free(n);
+    }
 }
 
 /*
- * Return number of elements in queue.
+ * Return number of elements in queue, in constant time.
  * Return 0 if q is NULL or empty
  */
 int q_size(struct list_head *head)
 {
-    if (!head || list_empty(head)) {
+    if (!head) {
         return 0;
     }
-    struct list_head *node;
-    int count = 0;
-    list_for_each (node, head) {
-        count++;
-    }
-    return count;
+    return q_header(head)->size;
 }
 
 /*
@@ -183,6 +1107,7 @@ bool q_delete_mid(struct list_head *head)
     }
     list_del(slow);
     q_release_element(list_entry(slow, element_t, list));
+    q_header(head)->size--;
     return true;
 }
 
@@ -208,21 +1133,84 @@ bool q_delete_dup(struct list_head *head)
     bool dup = false;
     list_for_each_entry_safe (node, safe, head, list) {
         if ((node->list.next != head) &&
-            (strcmp(node->value,
-                    list_entry(node->list.next, element_t, list)->value) ==
-             0)) {
+            q_element_equal(node,
+                            list_entry(node->list.next, element_t, list))) {
             list_del(&node->list);
             q_release_element(node);
+            q_header(head)->size--;
             dup = true;
         } else if (dup) {
             list_del(&node->list);
             q_release_element(node);
+            q_header(head)->size--;
             dup = false;
         }
     }
     return true;
 }
 
+typedef struct {
+    element_t *e;
+    size_t count;
+} dup_slot_t;
+
+/*
+ * Delete all nodes that have duplicate string, in any order.
+ * A first pass counts every string in a hash table sized from the length
+ * of the queue and remembers the slot of each element, a second one drops
+ * the elements whose string occurred more than once.
+ * Return false if list is NULL or could not allocate space.
+ */
+bool q_delete_dup_unsorted(struct list_head *head)
+{
+    if (!head || q_is_ring(head) || q_is_compact(head)) {
+        return false;
+    }
+    size_t n = q_size(head);
+    if (n < 2) {
+        return true;
+    }
+
+    size_t nslots = 16;
+    while (nslots < 2 * n) {
+        nslots <<= 1;
+    }
+    dup_slot_t *slots = malloc(nslots * sizeof(dup_slot_t));
+    size_t *where = malloc(n * sizeof(size_t));
+    if (!slots || !where) {
+        free(slots);
+        free(where);
+        return false;
+    }
+    memset(slots, 0, nslots * sizeof(dup_slot_t));
+
+    size_t i = 0;
+    element_t *node, *safe;
+    list_for_each_entry (node, head, list) {
+        size_t j = element_hash(node) & (nslots - 1);
+        while (slots[j].e && !q_element_equal(slots[j].e, node)) {
+            j = (j + 1) & (nslots - 1);
+        }
+        if (!slots[j].e) {
+            slots[j].e = node;
+        }
+        slots[j].count++;
+        where[i++] = j;
+    }
+
+    i = 0;
+    list_for_each_entry_safe (node, safe, head, list) {
+        if (slots[where[i++]].count > 1) {
+            list_del(&node->list);
+            q_release_element(node);
+            q_header(head)->size--;
+        }
+    }
+    free(slots);
+    free(where);
+    return true;
+}
+
 /*
  * Attempt to swap every two adjacent nodes.
  */
@@ -230,17 +1218,60 @@ bool q_delete_dup(struct list_head *head)
 void q_swap(struct list_head *head)
 {
     // https://leetcode.com/problems/swap-nodes-in-pairs/
-    if (!head || list_empty(head) || list_is_singular(head)) {
+    q_swapK(head, 1);
+}
+
+/*
+ * Exchange every two adjacent groups of k nodes, a group at the end without
+ * a partner stays in place.  Only the six links at the borders of each pair
+ * of groups change, the nodes inside are merely walked over.
+ */
+void q_swapK(struct list_head *head, int k)
+{
+    if (!head || q_is_ring(head) || q_is_compact(head) || k < 1) {
         return;
     }
-    struct list_head *node;
-    for (node = head->next; node != head && node->next != head;
-         node = node->next) {
-        struct list_head *tmp = node->next;
-        list_del(tmp);
-        list_add_tail(tmp, node);
+    int pairs = q_size(head) / k / 2;
+    struct list_head *prev = head;
+    while (pairs--) {
+        struct list_head *a = prev->next, *a_last = a;
+        for (int i = 1; i < k; i++) {
+            a_last = a_last->next;
+        }
+        struct list_head *b = a_last->next, *b_last = b;
+        for (int i = 1; i < k; i++) {
+            b_last = b_last->next;
+        }
+        struct list_head *after = b_last->next;
+
+        prev->next = b;
+        b->prev = prev;
+        b_last->next = a;
+        a->prev = b_last;
+        a_last->next = after;
+        after->prev = a_last;
+        prev = a_last;
     }
 }
+
+/*
+ * Exchange next and prev of the nodes from first up to but not including
+ * stop, in one pass over them.  The node two ahead is prefetched, since
+ * the pass is bound by the latency of following the links.
+ */
+static inline void reverse_links(struct list_head *first,
+                                 struct list_head *stop)
+{
+    struct list_head *node = first;
+    do {
+        struct list_head *next = node->next;
+        __builtin_prefetch(next->next, 1);
+        node->next = node->prev;
+        node->prev = next;
+        node = next;
+    } while (node != stop);
+}
+
 /*
  * Reverse elements in queue
  * No effect if q is NULL or empty
@@ -250,27 +1281,57 @@ void q_swap(struct list_head *head)
  */
 void q_reverse(struct list_head *head)
 {
+    if (q_is_compact(head)) {
+        compact_reverse(q_header(head)->compact);
+        return;
+    }
     if (!head || list_empty(head) || list_is_singular(head)) {
         return;
     }
-    struct list_head *node, *safe;
-    list_for_each_safe (node, safe, head) {
-        list_move(node, head);
+    /* Turning the head around too leaves a circular list in reverse */
+    reverse_links(head, head);
+}
+
+/*
+ * Reverse the nodes of the list k at a time, leaving the last
+ * q_size(head) % k nodes in order.
+ */
+void q_reverseK(struct list_head *head, int k)
+{
+    // https://leetcode.com/problems/reverse-nodes-in-k-group/
+    if (!head || q_is_ring(head) || q_is_compact(head) || k < 2) {
+        return;
+    }
+    int groups = q_size(head) / k;
+    struct list_head *prev = head;
+    while (groups--) {
+        struct list_head *first = prev->next, *last = first;
+        for (int i = 1; i < k; i++) {
+            last = last->next;
+        }
+        struct list_head *after = last->next;
+
+        reverse_links(first, after);
+        /* The ends of the group now point the wrong way, past the group */
+        prev->next = last;
+        last->prev = prev;
+        first->next = after;
+        after->prev = first;
+        prev = first;
     }
 }
 
 /*
- * Sort elements of queue in ascending order
- * No effect if q is NULL or empty. In addition, if q has only one
- * element, do nothing.
+ * Merge two NULL-terminated, singly-linked sorted lists.
+ * On ties the node from l1 comes first, which keeps the sort stable.
  */
 struct list_head *mergeTwoLists(struct list_head *l1, struct list_head *l2)
 {
     struct list_head *head = NULL, **ptr = &head, **node;
 
     for (node = NULL; l1 && l2; *node = (*node)->next) {
-        node = (strcmp(list_entry(l1, element_t, list)->value,
-                       list_entry(l2, element_t, list)->value) < 0)
+        node = (q_element_cmp(list_entry(l1, element_t, list),
+                              list_entry(l2, element_t, list)) <= 0)
                    ? &l1
                    : &l2;
         *ptr = *node;
@@ -282,43 +1343,522 @@ struct list_head *mergeTwoLists(struct list_head *l1, struct list_head *l2)
     return head;
 }
 
-struct list_head *mergesort(struct list_head *head)
+static inline int node_cmp(struct list_head *a, struct list_head *b)
+{
+    return q_element_cmp(list_entry(a, element_t, list),
+                         list_entry(b, element_t, list));
+}
+
+/*
+ * Detach the natural run at the front of *list and return it NULL
+ * terminated.  Ascending runs are taken as they are, descending runs are
+ * reversed while they are scanned.  Within a descending run, a group of
+ * equal strings is kept in its original order so the sort stays stable.
+ */
+static struct list_head *take_run(struct list_head **list, size_t *len)
+{
+    struct list_head *head = *list, *cur = head->next;
+    size_t n = 1;
+
+    if (cur && node_cmp(head, cur) > 0) {
+        /* last: node scanned most recently, tail of its group of equals */
+        struct list_head *last = head;
+        head->next = NULL;
+        while (cur) {
+            int cmp = node_cmp(last, cur);
+            if (cmp < 0) {
+                break;
+            }
+            struct list_head *next = cur->next;
+            if (cmp > 0) {
+                cur->next = head;
+                head = cur;
+            } else {
+                cur->next = last->next;
+                last->next = cur;
+            }
+            last = cur;
+            cur = next;
+            n++;
+        }
+    } else {
+        struct list_head *tail = head;
+        while (cur && node_cmp(tail, cur) <= 0) {
+            tail = cur;
+            cur = cur->next;
+            n++;
+        }
+        tail->next = NULL;
+    }
+
+    *list = cur;
+    *len = n;
+    return head;
+}
+
+/*
+ * Deep enough for any list: the collapse rules below keep run lengths on
+ * the stack growing at least like Fibonacci numbers.
+ */
+#define MAX_PENDING 96
+
+typedef struct {
+    struct list_head *head;
+    size_t len;
+} run_t;
+
+/* Merge pending runs i and i + 1 into slot i */
+static void merge_at(run_t *pending, int *cnt, int i)
 {
-    if (!head->next) {
-        return head;
+    pending[i].head = mergeTwoLists(pending[i].head, pending[i + 1].head);
+    pending[i].len += pending[i + 1].len;
+    if (i + 2 < *cnt) {
+        pending[i + 1] = pending[i + 2];
     }
-    struct list_head *fast = head, *slow = head, *mid;
-    while (true) {
-        if (!fast || !fast->next)
+    (*cnt)--;
+}
+
+/*
+ * Timsort style invariants: every pending run is longer than the two
+ * above it combined, so merges stay balanced and the stack stays short.
+ */
+static void merge_collapse(run_t *pending, int *cnt)
+{
+    while (*cnt > 1) {
+        int n = *cnt - 2;
+        if ((n > 0 &&
+             pending[n - 1].len <= pending[n].len + pending[n + 1].len) ||
+            (n > 1 &&
+             pending[n - 2].len <= pending[n - 1].len + pending[n].len)) {
+            if (pending[n - 1].len < pending[n + 1].len) {
+                n--;
+            }
+        } else if (pending[n].len > pending[n + 1].len) {
             break;
-        fast = fast->next->next;
-        slow = slow->next;
+        }
+        merge_at(pending, cnt, n);
     }
+}
+
+/*
+ * Sort a NULL-terminated, singly-linked list bottom-up.
+ * Natural runs are pushed in a single pass over the list and merged as
+ * they come in, so no level of the merge rescans the list and nothing
+ * recurses.  Only the next pointers are maintained.
+ */
+static struct list_head *list_sort(struct list_head *list)
+{
+    run_t pending[MAX_PENDING];
+    int cnt = 0;
 
-    mid = slow;
-    slow->prev->next = NULL;
+    while (list) {
+        pending[cnt].head = take_run(&list, &pending[cnt].len);
+        cnt++;
+        merge_collapse(pending, &cnt);
+    }
+    while (cnt > 1) {
+        merge_at(pending, &cnt, cnt - 2);
+    }
+    return pending[0].head;
+}
 
-    struct list_head *l1 = mergesort(head), *l2 = mergesort(mid);
-    return mergeTwoLists(l1, l2);
+/* Link a NULL-terminated, singly-linked list back into head */
+static void relink(struct list_head *head, struct list_head *node)
+{
+    struct list_head *tmp = head;
+    tmp->next = node;
+    while (tmp->next) {
+        tmp->next->prev = tmp;
+        tmp = tmp->next;
+    }
+    tmp->next = head;
+    head->prev = tmp;
 }
 
+/*
+ * Sort elements of queue in ascending order
+ * No effect if q is NULL or empty. In addition, if q has only one
+ * element, do nothing.
+ */
 void q_sort(struct list_head *head)
 {
+    if (q_is_compact(head)) {
+        compact_sort(q_header(head)->compact);
+        return;
+    }
     if (!head || list_empty(head) || list_is_singular(head)) {
         return;
     }
-    struct list_head *node = head->next, *tmp;
+    struct list_head *node = head->next;
     head->prev->next = NULL;
     head->next = NULL;
 
-    node = mergesort(node);
+    node = list_sort(node);
 
-    tmp = head;
-    tmp->next = node;
-    while (tmp->next) {
-        tmp->next->prev = tmp;
-        tmp = tmp->next;
+    /* Restore the prev pointers in one final pass */
+    relink(head, node);
+}
+
+/* Upper bound of threads used by q_sort_parallel() */
+#define PAR_MAX_THREADS 64
+
+/* Each thread gets at least this many elements, or the sort stays serial */
+#define PAR_MIN_CHUNK 16384
+
+typedef struct {
+    struct list_head *l1, *l2;
+} sort_job_t;
+
+static void *sort_worker(void *arg)
+{
+    sort_job_t *job = arg;
+    job->l1 = list_sort(job->l1);
+    return NULL;
+}
+
+static void *merge_worker(void *arg)
+{
+    sort_job_t *job = arg;
+    job->l1 = mergeTwoLists(job->l1, job->l2);
+    return NULL;
+}
+
+/*
+ * Run worker on jobs[0..njobs), jobs[0] on the calling thread.
+ * A job whose thread cannot be created runs on the calling thread too.
+ */
+static void run_jobs(void *(*worker)(void *), sort_job_t *jobs, int njobs)
+{
+    pthread_t tids[PAR_MAX_THREADS];
+    bool started[PAR_MAX_THREADS];
+
+    for (int i = 1; i < njobs; i++) {
+        started[i] = !pthread_create(&tids[i], NULL, worker, &jobs[i]);
     }
-    tmp->next = head;
-    head->prev = tmp;
-}
\ No newline at end of file
+    worker(&jobs[0]);
+    for (int i = 1; i < njobs; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        } else {
+            worker(&jobs[i]);
+        }
+    }
+}
+
+/*
+ * Sort elements of queue in ascending order using up to nthreads threads.
+ * Chunks are sorted with list_sort() and merged pairwise with
+ * mergeTwoLists(), every round of merges running in parallel.
+ */
+void q_sort_parallel(struct list_head *head, int nthreads)
+{
+    if (q_is_compact(head)) {
+        q_sort(head);
+        return;
+    }
+    if (!head || list_empty(head) || list_is_singular(head)) {
+        return;
+    }
+    int n = q_size(head);
+    if (nthreads > PAR_MAX_THREADS) {
+        nthreads = PAR_MAX_THREADS;
+    }
+    if (nthreads > n / PAR_MIN_CHUNK) {
+        nthreads = n / PAR_MIN_CHUNK;
+    }
+    if (nthreads <= 1) {
+        q_sort(head);
+        return;
+    }
+
+    /* Cut the ring into NULL-terminated chunks of nearly equal length */
+    sort_job_t jobs[PAR_MAX_THREADS];
+    struct list_head *node = head->next;
+    head->prev->next = NULL;
+    for (int i = 0; i < nthreads; i++) {
+        int len = n / nthreads + (i < n % nthreads);
+        jobs[i].l1 = node;
+        while (--len) {
+            node = node->next;
+        }
+        struct list_head *next = node->next;
+        node->next = NULL;
+        node = next;
+    }
+
+    /*
+     * Workers inherit the signal mask, so keep SIGALRM on this thread and
+     * hold it until the list is whole again.  A time limit which expires
+     * meanwhile still fires once the mask is restored.
+     */
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+
+    run_jobs(sort_worker, jobs, nthreads);
+    for (int k = nthreads; k > 1; k = (k + 1) / 2) {
+        sort_job_t pairs[PAR_MAX_THREADS / 2];
+        int npairs = k / 2;
+        for (int i = 0; i < npairs; i++) {
+            pairs[i].l1 = jobs[2 * i].l1;
+            pairs[i].l2 = jobs[2 * i + 1].l1;
+        }
+        run_jobs(merge_worker, pairs, npairs);
+        for (int i = 0; i < npairs; i++) {
+            jobs[i].l1 = pairs[i].l1;
+        }
+        if (k & 1) {
+            jobs[npairs].l1 = jobs[k - 1].l1;
+        }
+    }
+
+    relink(head, jobs[0].l1);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/* Queues which q_merge() and q_split() can relink elements between */
+static bool is_plain_queue(struct list_head *head)
+{
+    queue_t *q = head ? q_header(head) : NULL;
+    return q && !q->ring && !q->compact && !q->pool;
+}
+
+/*
+ * Merge the sorted queues heads[1..k) into heads[0] by merging neighbours
+ * pairwise, halving the number of lists each round.
+ */
+bool q_merge(struct list_head **heads, int k)
+{
+    if (k < 1) {
+        return false;
+    }
+    for (int i = 0; i < k; i++) {
+        if (!is_plain_queue(heads[i])) {
+            return false;
+        }
+    }
+    if (k == 1) {
+        return true;
+    }
+
+    /*
+     * Detach every queue as a NULL-terminated list, which is kept in the
+     * next pointer of its head for the rounds of merges, so nothing has to
+     * be allocated.
+     */
+    int size = 0;
+    for (int i = 0; i < k; i++) {
+        struct list_head *head = heads[i];
+        size += q_header(head)->size;
+        if (list_empty(head)) {
+            head->next = NULL;
+        } else {
+            head->prev->next = NULL;
+        }
+    }
+
+    for (int n = k; n > 1; n = (n + 1) / 2) {
+        for (int i = 0; i < n / 2; i++) {
+            heads[i]->next =
+                mergeTwoLists(heads[2 * i]->next, heads[2 * i + 1]->next);
+        }
+        if (n & 1) {
+            heads[n / 2]->next = heads[n - 1]->next;
+        }
+    }
+
+    struct list_head *merged = heads[0]->next;
+    for (int i = 0; i < k; i++) {
+        INIT_LIST_HEAD(heads[i]);
+        q_header(heads[i])->size = 0;
+    }
+    if (merged) {
+        relink(heads[0], merged);
+    }
+    q_header(heads[0])->size = size;
+    return true;
+}
+
+/* Cut head into k consecutive shares, walking the queue once */
+bool q_split(struct list_head *head, struct list_head **parts, int k)
+{
+    if (k < 1 || !is_plain_queue(head)) {
+        return false;
+    }
+    for (int i = 0; i < k - 1; i++) {
+        if (!is_plain_queue(parts[i]) || !list_empty(parts[i])) {
+            return false;
+        }
+    }
+
+    int n = q_header(head)->size;
+    struct list_head rest;
+    INIT_LIST_HEAD(&rest);
+    list_splice_init(head, &rest);
+    for (int i = 0; i < k; i++) {
+        struct list_head *to = i ? parts[i - 1] : head;
+        int len = n / k + (i < n % k);
+        struct list_head *node = &rest;
+        for (int j = 0; j < len; j++) {
+            node = node->next;
+        }
+        list_cut_position(to, &rest, node);
+        q_header(to)->size = len;
+    }
+    return true;
+}
+
+static inline int key_cmp(const q_sortkey_t *a, const q_sortkey_t *b)
+{
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+    /* A zero last byte means both strings ended inside the prefix */
+    if (!(a->prefix & 0xff)) {
+        return 0;
+    }
+    return str_compare(a->e->value + 8, q_element_len(a->e) - 8,
+                       b->e->value + 8, q_element_len(b->e) - 8);
+}
+
+static inline void key_swap(q_sortkey_t *a, q_sortkey_t *b)
+{
+    q_sortkey_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void key_insertion_sort(q_sortkey_t *keys, size_t n)
+{
+    for (size_t i = 1; i < n; i++) {
+        q_sortkey_t k = keys[i];
+        size_t j = i;
+        while (j > 0 && key_cmp(&k, &keys[j - 1]) < 0) {
+            keys[j] = keys[j - 1];
+            j--;
+        }
+        keys[j] = k;
+    }
+}
+
+static void key_sift_down(q_sortkey_t *keys, size_t root, size_t n)
+{
+    size_t child;
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && key_cmp(&keys[child], &keys[child + 1]) < 0) {
+            child++;
+        }
+        if (key_cmp(&keys[root], &keys[child]) >= 0) {
+            return;
+        }
+        key_swap(&keys[root], &keys[child]);
+        root = child;
+    }
+}
+
+static void key_heap_sort(q_sortkey_t *keys, size_t n)
+{
+    for (size_t i = n / 2; i-- > 0;) {
+        key_sift_down(keys, i, n);
+    }
+    for (size_t i = n - 1; i > 0; i--) {
+        key_swap(&keys[0], &keys[i]);
+        key_sift_down(keys, 0, i);
+    }
+}
+
+/* Slices at most this long are finished with insertion sort */
+#define INTROSORT_THRESHOLD 16
+
+/*
+ * Introsort: quicksort with median-of-three pivots, falling back to heap
+ * sort once depth runs out.  Recurse on the smaller side only, so the
+ * stack stays logarithmic.
+ */
+static void key_introsort(q_sortkey_t *keys, size_t n, int depth)
+{
+    while (n > INTROSORT_THRESHOLD) {
+        if (!depth--) {
+            key_heap_sort(keys, n);
+            return;
+        }
+
+        size_t mid = n / 2;
+        if (key_cmp(&keys[mid], &keys[0]) < 0) {
+            key_swap(&keys[mid], &keys[0]);
+        }
+        if (key_cmp(&keys[n - 1], &keys[0]) < 0) {
+            key_swap(&keys[n - 1], &keys[0]);
+        }
+        if (key_cmp(&keys[n - 1], &keys[mid]) < 0) {
+            key_swap(&keys[n - 1], &keys[mid]);
+        }
+        /* Keep the pivot out of the way at n - 2 */
+        key_swap(&keys[mid], &keys[n - 2]);
+        q_sortkey_t *pivot = &keys[n - 2];
+
+        size_t i = 0, j = n - 2;
+        for (;;) {
+            while (key_cmp(&keys[++i], pivot) < 0) {
+            }
+            while (key_cmp(pivot, &keys[--j]) < 0) {
+            }
+            if (i >= j) {
+                break;
+            }
+            key_swap(&keys[i], &keys[j]);
+        }
+        key_swap(&keys[i], &keys[n - 2]);
+
+        size_t left = i, right = n - i - 1;
+        if (left < right) {
+            key_introsort(keys, left, depth);
+            keys += i + 1;
+            n = right;
+        } else {
+            key_introsort(keys + i + 1, right, depth);
+            n = left;
+        }
+    }
+    key_insertion_sort(keys, n);
+}
+
+/*
+ * Sort elements of queue in ascending order through a contiguous array
+ * of key prefixes.  keys must have room for q_size(head) entries.
+ */
+void q_sort_keys(struct list_head *head, q_sortkey_t *keys)
+{
+    if (q_is_compact(head)) {
+        q_sort(head);
+        return;
+    }
+    if (!head || list_empty(head) || list_is_singular(head)) {
+        return;
+    }
+
+    size_t n = 0;
+    element_t *entry;
+    list_for_each_entry (entry, head, list) {
+        keys[n].prefix = q_element_prefix(entry);
+        keys[n].e = entry;
+        n++;
+    }
+
+    int depth = 0;
+    for (size_t m = n; m > 1; m >>= 1) {
+        depth += 2;
+    }
+    key_introsort(keys, n, depth);
+
+    struct list_head *prev = head;
+    for (size_t i = 0; i < n; i++) {
+        struct list_head *node = &keys[i].e->list;
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
@@ -10,7 +10,10 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "list.h"
+#include "strops.h"
 
 /* Linked list element */
 typedef struct {
@@ -19,8 +22,115 @@ typedef struct {
      */
     char *value;
     struct list_head list;
+#ifdef ELEMENT_META
+    /*
+     * Built with ELEMENT_META=1, the insert paths fill these in from value,
+     * which must not change afterwards: its length, its hash, and its first
+     * 8 bytes packed big-endian and zero padded, so that integer order is
+     * strcmp order.  They double the size of an element.
+     */
+    size_t len;
+    uint64_t hash;
+    uint64_t prefix;
+#endif
 } element_t;
 
+/* Length of the string of e */
+static inline size_t q_element_len(const element_t *e)
+{
+#ifdef ELEMENT_META
+    return e->len;
+#else
+    return strlen(e->value);
+#endif
+}
+
+/* First 8 bytes of the string of e packed big-endian, zero padded */
+static inline uint64_t q_element_prefix(const element_t *e)
+{
+#ifdef ELEMENT_META
+    return e->prefix;
+#else
+    uint64_t prefix = 0;
+    for (int i = 0; i < 8 && e->value[i]; i++)
+        prefix |= (uint64_t) (unsigned char) e->value[i] << (56 - 8 * i);
+    return prefix;
+#endif
+}
+
+/*
+ * Compare the strings of a and b like strcmp() does, with str_compare().
+ * With ELEMENT_META, the string bytes are only looked at when the prefixes
+ * tie.
+ */
+static inline int q_element_cmp(const element_t *a, const element_t *b)
+{
+#ifdef ELEMENT_META
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    /* A zero last byte means both strings ended inside the prefix */
+    if (!(a->prefix & 0xff))
+        return 0;
+    return str_compare(a->value + 8, a->len - 8, b->value + 8, b->len - 8);
+#else
+    return str_compare(a->value, q_element_len(a), b->value, q_element_len(b));
+#endif
+}
+
+/*
+ * Return true if a and b hold the same string.  With ELEMENT_META, that is
+ * usually decided without reading the strings.
+ */
+static inline bool q_element_equal(const element_t *a, const element_t *b)
+{
+#ifdef ELEMENT_META
+    return a->hash == b->hash && a->len == b->len &&
+           !memcmp(a->value, b->value, a->len);
+#else
+    size_t len = q_element_len(a);
+    return len == q_element_len(b) &&
+           !str_compare(a->value, len, b->value, len);
+#endif
+}
+
+/* Slab pool elements of a queue are carved from, see q_new_pool() */
+struct q_pool;
+
+/* Array of element handles a ring queue keeps, see q_new_ring() */
+struct q_ring;
+
+/* Arena of index linked nodes a compact queue keeps, see q_new_compact() */
+struct q_compact;
+
+/*
+ * Queue header.
+ * q_new() hands out a pointer to the embedded list head, so callers keep
+ * using a plain struct list_head *, while every operation which links or
+ * unlinks elements keeps the element count up to date.
+ * All q_* operations expect a head returned by q_new().
+ */
+typedef struct {
+    struct list_head head;
+    /* Number of elements linked into head */
+    int size;
+    /* Element pool, NULL when every element is allocated on its own */
+    struct q_pool *pool;
+    /* Element handles of a ring queue, NULL when elements are linked */
+    struct q_ring *ring;
+    /* Node arena of a compact queue, NULL when elements are linked */
+    struct q_compact *compact;
+} queue_t;
+
+/* Get the queue header owning a list head returned by q_new() */
+#define q_header(h) container_of(h, queue_t, head)
+
+/* Entry of the scratch array used by q_sort_keys() */
+typedef struct {
+    /* First 8 bytes of the string packed big-endian, zero padded */
+    uint64_t prefix;
+    element_t *e;
+} q_sortkey_t;
+
 /* Operations on queue */
 
 /*
@@ -29,6 +139,68 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/*
+ * Create empty queue whose elements are carved from slabs.
+ * Strings that fit in a slab node are stored inline, longer ones are
+ * allocated separately.  Removed elements must still be released with
+ * q_release_element(), and q_free() drops all slabs at once.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_pool();
+
+/*
+ * Create empty queue whose elements are kept in a growable ring buffer of
+ * element handles instead of being linked into the list head, which stays
+ * empty.  q_insert_*, q_remove_*, q_size, q_release_element and q_free
+ * work as for any other queue, in amortized constant time; the remaining
+ * operations see an empty list and leave the queue alone.  Walk the
+ * elements with q_ring_entry().
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_ring();
+
+/* Return true if head was created by q_new_ring() */
+static inline bool q_is_ring(struct list_head *head)
+{
+    return head && q_header(head)->ring;
+}
+
+/*
+ * Return the element at position i, counted from the head of a ring queue.
+ * Return NULL if head is not a ring queue or i is out of range.
+ */
+element_t *q_ring_entry(struct list_head *head, size_t i);
+
+/*
+ * Create empty queue whose strings are kept in 32-byte arena nodes linked
+ * by 32-bit indices instead of in element_t, which takes about half the
+ * memory per element.  Strings shorter than 20 bytes are stored in the
+ * node, longer ones are allocated separately.  As for a ring queue, the
+ * list head stays empty and only q_insert_*, q_remove_*, q_size,
+ * q_release_element and q_free work on the elements, besides q_reverse and
+ * the q_sort functions, which relink the nodes in place.  Removing an
+ * element allocates the element_t handed out, so it fails when out of
+ * memory.
+ * Read the strings with q_compact_value().
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_compact();
+
+/* Return true if head was created by q_new_compact() */
+static inline bool q_is_compact(struct list_head *head)
+{
+    return head && q_header(head)->compact;
+}
+
+/*
+ * Return the string at position i, counted from the head of a compact
+ * queue.  The queue is walked from its nearer end, or from the string read
+ * last, so reading the strings in order takes constant time each.  The
+ * string stays valid until the element is removed.
+ * Return NULL if head is not a compact queue or i is out of range.
+ */
+const char *q_compact_value(struct list_head *head, size_t i);
+
 /*
  * Free ALL storage used by queue.
  * No effect if q is NULL
@@ -53,6 +225,24 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/*
+ * Attempt to insert n elements at head of queue.
+ * The result is the same as calling q_insert_head() on strs[0] up to
+ * strs[n - 1] in turn, but all elements are built into a private chain
+ * first and linked into the queue with a single splice.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, in which case the
+ * queue is left unchanged.
+ */
+bool q_insert_head_bulk(struct list_head *head, char **strs, size_t n);
+
+/*
+ * Attempt to insert n elements at tail of queue.
+ * The result is the same as calling q_insert_tail() on strs[0] up to
+ * strs[n - 1] in turn.  Other attribute is as same as q_insert_head_bulk.
+ */
+bool q_insert_tail_bulk(struct list_head *head, char **strs, size_t n);
+
 /*
  * Attempt to remove element from head of queue.
  * Return target element.
@@ -75,13 +265,27 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove the first n elements from head of queue at once.
+ * The removed elements are moved, in order, onto the list out, which is
+ * reinitialized first; no string is copied.  If the queue holds fewer
+ * than n elements, all of them are removed.
+ * Each element on out must be released with q_release_element(), out is
+ * a plain list and not a queue created by q_new().  A compact queue stops
+ * short when it cannot allocate the elements handed out.
+ * Return number of elements removed, 0 if q is NULL or empty.
+ */
+size_t q_remove_head_n(struct list_head *head,
+                       size_t n,
+                       struct list_head *out);
+
 /*
  * Attempt to release element.
  */
 void q_release_element(element_t *e);
 
 /*
- * Return number of elements in queue.
+ * Return number of elements in queue, in constant time.
  * Return 0 if q is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -108,6 +312,15 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/*
+ * Delete all nodes that have duplicate string, like q_delete_dup(), but
+ * without the list having to be sorted first.  The order of the remaining
+ * nodes is kept.
+ * Return true if successful.
+ * Return false if list is NULL or a ring queue, or could not allocate space.
+ */
+bool q_delete_dup_unsorted(struct list_head *head);
+
 /*
  * Attempt to swap every two adjacent nodes.
  *
@@ -115,6 +328,13 @@ bool q_delete_dup(struct list_head *head);
  */
 void q_swap(struct list_head *head);
 
+/*
+ * Attempt to swap every two adjacent groups of k nodes, q_swap() being the
+ * case of k == 1.  A group without a partner at the end stays in place.
+ * No effect if q is NULL or a ring queue, or k is less than 1.
+ */
+void q_swapK(struct list_head *head, int k);
+
 /*
  * Reverse elements in queue
  * No effect if q is NULL or empty
@@ -124,6 +344,17 @@ void q_swap(struct list_head *head);
  */
 void q_reverse(struct list_head *head);
 
+/*
+ * Reverse the nodes of the list k at a time, the last nodes that do not
+ * make up a whole group stay in order.
+ * No effect if q is NULL or a ring queue, or k is less than 2.
+ * Like q_reverse(), this function should not allocate or free any list
+ * elements.
+ *
+ * Ref: https://leetcode.com/problems/reverse-nodes-in-k-group/
+ */
+void q_reverseK(struct list_head *head, int k);
+
 /*
  * Sort elements of queue in ascending order
  * No effect if q is NULL or empty. In addition, if q has only one
@@ -131,4 +362,45 @@ void q_reverse(struct list_head *head);
  */
 void q_sort(struct list_head *head);
 
+/*
+ * Sort elements of queue in ascending order through a contiguous array.
+ * The element pointers and their key prefixes are gathered into keys,
+ * which must have room for q_size(head) entries, the array is sorted with
+ * strcmp() only consulted on prefix ties, and the list is relinked in one
+ * pass.  No memory is allocated, so the caller provides the scratch space.
+ * No effect if q is NULL, empty or has only one element.
+ */
+void q_sort_keys(struct list_head *head, q_sortkey_t *keys);
+
+/*
+ * Sort elements of queue in ascending order using up to nthreads threads.
+ * The list is cut into one chunk per thread, the chunks are sorted
+ * concurrently and then merged pairwise, again in parallel.  Short queues
+ * and nthreads <= 1 fall back to q_sort().  No memory is allocated.
+ */
+void q_sort_parallel(struct list_head *head, int nthreads);
+
+/*
+ * Merge the sorted queues heads[1] up to heads[k - 1] into heads[0], which
+ * must be sorted as well.  Queues are merged pairwise in rounds, so n
+ * elements in total take O(n log k) comparisons.  Elements are only
+ * relinked, the other queues are left empty and are not freed.  On ties
+ * the element of the queue earlier in heads comes first.
+ * Return true if successful.
+ * Return false, leaving every queue unchanged, if a queue is NULL, a ring
+ * queue or pooled, since pooled elements must stay in their own queue.
+ */
+bool q_merge(struct list_head **heads, int k);
+
+/*
+ * Partition queue into k queues of consecutive elements.  head keeps the
+ * first n / k elements, rounded up, and the remaining shares are moved in
+ * order to parts[0] up to parts[k - 2], the first n % k shares holding one
+ * element more than the others.  Nothing is allocated.
+ * Return true if successful.
+ * Return false, leaving every queue unchanged, if a queue is NULL, a ring
+ * queue or pooled, or one of parts is not empty.
+ */
+bool q_split(struct list_head *head, struct list_head **parts, int k);
+
 #endif /* LAB0_QUEUE_H */
@@ -1,39 +1,196 @@
 #include "random.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/random.h>
 #include <unistd.h>
 
-/* shameless stolen from ebacs */
-void randombytes(uint8_t *x, size_t how_much)
+/*
+ * Every thread runs a ChaCha20 generator of its own, so that randombytes()
+ * is a copy out of a buffer for most calls and threads never contend.
+ * Each refill produces CHACHA_BLOCKS blocks.  The first 32 bytes become
+ * the next key and are never handed out, so that a state leaked later
+ * does not give away earlier output.
+ */
+#define CHACHA_BLOCKS 16
+#define CHACHA_BUFSIZE (64 * CHACHA_BLOCKS)
+#define CHACHA_KEYSIZE 32
+
+typedef struct {
+    /* Key, block counter and stream, as laid out in the ChaCha20 state */
+    uint32_t state[16];
+    uint8_t buf[CHACHA_BUFSIZE];
+    /* Bytes of buf handed out already */
+    size_t pos;
+    /* Seed generation the key was derived from, 0 before the first use */
+    unsigned long generation;
+} chacha_rng_t;
+
+static __thread chacha_rng_t rng;
+
+/* Bumped by randombytes_seed(), which makes every thread rekey */
+static atomic_ulong seed_generation = 1;
+static _Atomic uint64_t fixed_seed = 0;
+/* Streams handed out to threads since the last fixed seed */
+static atomic_uint next_stream = 0;
+
+/* Fill x from the kernel, for keys when there is no fixed seed */
+static void kernel_random(uint8_t *x, size_t xlen)
 {
-    ssize_t i;
-    static int fd = -1;
+    while (xlen > 0) {
+        ssize_t i = getrandom(x, xlen, 0);
+        if (i < 0 && errno == ENOSYS)
+            break;
+        if (i < 1)
+            continue;
+        x += i;
+        xlen -= i;
+    }
 
-    ssize_t xlen = (ssize_t) how_much;
-    assert(xlen >= 0);
-    if (fd == -1) {
-        for (;;) {
-            fd = open("/dev/urandom", O_RDONLY);
-            if (fd != -1)
-                break;
+    /* Kernels older than 3.17 only offer the device */
+    while (xlen > 0) {
+        int fd = open("/dev/urandom", O_RDONLY);
+        if (fd == -1) {
             sleep(1);
+            continue;
+        }
+        while (xlen > 0) {
+            ssize_t i = read(fd, x, xlen < 1048576 ? xlen : 1048576);
+            if (i < 1) {
+                sleep(1);
+                continue;
+            }
+            x += i;
+            xlen -= i;
         }
+        close(fd);
     }
+}
 
-    while (xlen > 0) {
-        if (xlen < 1048576)
-            i = xlen;
-        else
-            i = 1048576;
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
 
-        i = read(fd, x, (size_t) i);
-        if (i < 1) {
-            sleep(1);
-            continue;
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL32(d ^ a, 16);   \
+        c += d;                  \
+        b = ROTL32(b ^ c, 12);   \
+        a += b;                  \
+        d = ROTL32(d ^ a, 8);    \
+        c += d;                  \
+        b = ROTL32(b ^ c, 7);    \
+    } while (0)
+
+static void chacha20_block(const uint32_t in[16], uint8_t out[64])
+{
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+static void set_key(chacha_rng_t *r, const uint8_t key[CHACHA_KEYSIZE])
+{
+    for (int i = 0; i < 8; i++)
+        r->state[4 + i] = load32(key + 4 * i);
+}
+
+static void refill(chacha_rng_t *r)
+{
+    for (int i = 0; i < CHACHA_BLOCKS; i++) {
+        chacha20_block(r->state, r->buf + 64 * i);
+        /* 64-bit block counter in words 12 and 13 */
+        if (!++r->state[12])
+            r->state[13]++;
+    }
+    set_key(r, r->buf);
+    memset(r->buf, 0, CHACHA_KEYSIZE);
+    r->pos = CHACHA_KEYSIZE;
+}
+
+/* Key the generator of the calling thread for the current seed */
+static void rekey(chacha_rng_t *r, unsigned long generation)
+{
+    static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32,
+                                      0x6b206574}; /* "expand 32-byte k" */
+    uint8_t key[CHACHA_KEYSIZE];
+    uint32_t stream = 0;
+    uint64_t seed = atomic_load(&fixed_seed);
+    if (seed) {
+        /* SplitMix64 spreads the seed over the key */
+        for (int i = 0; i < CHACHA_KEYSIZE; i += 8) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            z ^= z >> 31;
+            memcpy(key + i, &z, 8);
         }
+        stream = atomic_fetch_add(&next_stream, 1);
+    } else {
+        kernel_random(key, sizeof(key));
+    }
 
-        x += i;
-        xlen -= i;
+    memcpy(r->state, sigma, sizeof(sigma));
+    set_key(r, key);
+    r->state[12] = r->state[13] = 0;
+    r->state[14] = stream;
+    r->state[15] = 0;
+    r->generation = generation;
+    refill(r);
+}
+
+void randombytes(uint8_t *x, size_t how_much)
+{
+    ssize_t xlen = (ssize_t) how_much;
+    assert(xlen >= 0);
+
+    chacha_rng_t *r = &rng;
+    unsigned long generation = atomic_load(&seed_generation);
+    if (r->generation != generation)
+        rekey(r, generation);
+
+    while (how_much > 0) {
+        if (r->pos == CHACHA_BUFSIZE)
+            refill(r);
+        size_t n = CHACHA_BUFSIZE - r->pos;
+        if (n > how_much)
+            n = how_much;
+        memcpy(x, r->buf + r->pos, n);
+        /* Bytes handed out are not kept around */
+        memset(r->buf + r->pos, 0, n);
+        r->pos += n;
+        x += n;
+        how_much -= n;
     }
 }
+
+void randombytes_seed(uint64_t seed)
+{
+    atomic_store(&fixed_seed, seed);
+    atomic_store(&next_stream, 0);
+    atomic_fetch_add(&seed_generation, 1);
+}
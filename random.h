@@ -4,8 +4,21 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/*
+ * Fill x with xlen random bytes.
+ * Each thread draws from a ChaCha20 generator of its own, keyed from the
+ * kernel on first use.
+ */
 void randombytes(uint8_t *x, size_t xlen);
 
+/*
+ * Make randombytes() reproducible: key every generator from seed instead
+ * of the kernel, or from the kernel again if seed is 0.  Threads rekey on
+ * their next call.  They get streams of their own, numbered in the order
+ * in which they rekey, so output repeats exactly for a single thread.
+ */
+void randombytes_seed(uint64_t seed);
+
 static inline uint8_t randombit(void)
 {
     uint8_t ret = 0;
@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import subprocess
+import sys
+import getopt
+import json
+import math
+
+
+# Throughput regression gate on top of qbench
+#
+# qbench is run several times.  For every case, the median throughput over
+# the runs is taken together with a distribution-free confidence interval,
+# and compared with a stored baseline.  A case regresses when its median
+# drops by more than the threshold and the two intervals do not overlap,
+# so that noise between runs alone does not fail the gate.  Below 9 runs,
+# the 95% interval spans all the samples from the slowest to the fastest,
+# and a single noisy run is enough to keep a regression from failing.
+class Comparer:
+
+    qbench = "./qbench"
+    runs = 9
+    threshold = 10.0
+    confidence = 0.95
+    benchArgs = []
+    colored = False
+
+    RED = '\033[91m'
+    GREEN = '\033[92m'
+    WHITE = '\033[0m'
+
+    def __init__(self,
+                 qbench="",
+                 runs=0,
+                 threshold=None,
+                 benchArgs=None,
+                 colored=False):
+        if qbench != "":
+            self.qbench = qbench
+        if runs > 0:
+            self.runs = runs
+        if threshold is not None:
+            self.threshold = threshold
+        if benchArgs is not None:
+            self.benchArgs = benchArgs
+        self.colored = colored
+
+    def printInColor(self, text, color):
+        if self.colored == False:
+            color = self.WHITE
+        print(color, text, self.WHITE, sep = '')
+
+    @staticmethod
+    def caseKey(result):
+        return "%s/%d/%s/%s" % (result["op"], result["size"],
+                                result["length"], result["order"])
+
+    def medianInterval(self, samples):
+        # Order statistics around the median, from the binomial distribution
+        xs = sorted(samples)
+        n = len(xs)
+        if n % 2:
+            median = xs[n // 2]
+        else:
+            median = (xs[n // 2 - 1] + xs[n // 2]) / 2
+        alpha = 1 - self.confidence
+        k = 0
+        tail = 0.0
+        while k < n // 2:
+            tail += math.comb(n, k) / 2 ** n
+            if tail > alpha / 2:
+                break
+            k += 1
+        lo = xs[max(k - 1, 0)]
+        hi = xs[min(n - k, n - 1)]
+        return median, lo, hi
+
+    def measure(self):
+        samples = {}
+        clist = [self.qbench, "-f", "json", "-r", "1"] + self.benchArgs
+        for r in range(self.runs):
+            print("+++ Run %d/%d: %s" % (r + 1, self.runs, " ".join(clist)))
+            try:
+                out = subprocess.check_output(clist)
+            except Exception as e:
+                self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
+                sys.exit(2)
+            for result in json.loads(out)["results"]:
+                samples.setdefault(self.caseKey(result), []).append(result["ops_per_sec"])
+        cases = {}
+        for key, xs in samples.items():
+            median, lo, hi = self.medianInterval(xs)
+            cases[key] = {"median": median, "lo": lo, "hi": hi, "samples": xs}
+        return cases
+
+    def loadBaseline(self, fname):
+        with open(fname) as f:
+            data = json.load(f)
+        if "cases" in data:
+            return data["cases"]
+        # Plain qbench output: one sample per case, without any spread
+        cases = {}
+        for result in data["results"]:
+            x = result["ops_per_sec"]
+            cases[self.caseKey(result)] = {"median": x, "lo": x, "hi": x, "samples": [x]}
+        return cases
+
+    def save(self, cases, fname):
+        with open(fname, "w") as f:
+            json.dump({"confidence": self.confidence, "runs": self.runs, "cases": cases},
+                      f, indent=1, sort_keys=True)
+            f.write("\n")
+
+    def compare(self, baseline, cases):
+        regressions = 0
+        print("---\tCase\t\t\t\tBaseline\tCurrent\t\tChange")
+        for key in sorted(cases.keys()):
+            if not key in baseline:
+                continue
+            base = baseline[key]
+            cur = cases[key]
+            change = (cur["median"] - base["median"]) * 100.0 / base["median"]
+            line = "---\t%-30s\t%.0f\t%.0f\t%+.1f%%" % (key, base["median"], cur["median"], change)
+            if change < -self.threshold and cur["hi"] < base["lo"]:
+                self.printInColor(line + "\tREGRESSION", self.RED)
+                regressions += 1
+            elif change > self.threshold and cur["lo"] > base["hi"]:
+                self.printInColor(line + "\tfaster", self.GREEN)
+            else:
+                print(line)
+        missing = [k for k in baseline.keys() if not k in cases]
+        if missing:
+            print("--- %d baseline cases were not measured" % len(missing))
+        if regressions:
+            self.printInColor("--- %d cases regressed by more than %.1f%%" %
+                              (regressions, self.threshold), self.RED)
+        else:
+            self.printInColor("--- No regressions beyond %.1f%%" % self.threshold, self.GREEN)
+        return regressions == 0
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PROG] [-r RUNS] [-t PCT] [-b FILE] [-s FILE] [-a ARGS] [-c]" % name)
+    print("  -h        Print this message")
+    print("  -p PROG   Benchmark program (default ./qbench)")
+    print("  -r RUNS   Number of benchmark runs (default 9; with fewer, the")
+    print("            interval spans min..max and the gate rarely fails)")
+    print("  -t PCT    Allowed throughput drop in percent (default 10)")
+    print("  -b FILE   Compare against baseline FILE")
+    print("  -s FILE   Save the measured results to FILE as a new baseline")
+    print("  -a ARGS   Extra arguments for the benchmark program")
+    print("  -c        Enable colored text")
+    sys.exit(0)
+
+
+def run(name, args):
+    prog = ""
+    runs = 0
+    threshold = None
+    baseline = None
+    saveFile = None
+    benchArgs = None
+    colored = False
+
+    optlist, args = getopt.getopt(args, 'hp:r:t:b:s:a:c')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            prog = val
+        elif opt == '-r':
+            runs = int(val)
+        elif opt == '-t':
+            threshold = float(val)
+        elif opt == '-b':
+            baseline = val
+        elif opt == '-s':
+            saveFile = val
+        elif opt == '-a':
+            benchArgs = val.split()
+        elif opt == '-c':
+            colored = True
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+    if baseline is None and saveFile is None:
+        print("Nothing to do: give a baseline to compare with, or a file to save")
+        usage(name)
+    c = Comparer(qbench=prog,
+                 runs=runs,
+                 threshold=threshold,
+                 benchArgs=benchArgs,
+                 colored=colored)
+    base = c.loadBaseline(baseline) if baseline else None
+    cases = c.measure()
+    if saveFile:
+        c.save(cases, saveFile)
+    if base is not None and not c.compare(base, cases):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
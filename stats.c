@@ -0,0 +1,213 @@
+#include "stats.h"
+#include <string.h>
+
+#include "report.h"
+
+#define STAT_SUB_BITS 5
+#define STAT_SUB_HALF (1 << (STAT_SUB_BITS - 1))
+/* Buckets needed to cover values up to 2^63 */
+#define STAT_BUCKETS ((66 - STAT_SUB_BITS) * STAT_SUB_HALF)
+
+typedef struct {
+    uint64_t counts[STAT_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+static histogram_t histograms[STAT_NR];
+
+/* Hardware counter totals of each operation */
+typedef struct {
+    uint64_t sums[PMU_NR];
+    uint64_t samples;
+} pmu_totals_t;
+
+static pmu_totals_t pmu_totals[STAT_NR];
+static pmu_sample_t pmu_start;
+static bool pmu_started = false;
+
+/* Command names, used as operation names in the output */
+static const char *const stat_names[STAT_NR] = {
+    [STAT_NEW] = "new",         [STAT_FREE] = "free",
+    [STAT_IH] = "ih",           [STAT_IT] = "it",
+    [STAT_IH_BULK] = "ih_bulk", [STAT_IT_BULK] = "it_bulk",
+    [STAT_RH] = "rh",           [STAT_RT] = "rt",
+    [STAT_RHN] = "rhn",         [STAT_SIZE] = "size",
+    [STAT_REVERSE] = "reverse", [STAT_SORT] = "sort",
+    [STAT_DM] = "dm",           [STAT_DEDUP] = "dedup",
+    [STAT_SWAP] = "swap",       [STAT_MERGE] = "merge",
+    [STAT_SPLIT] = "split",     [STAT_REVERSEK] = "reverseK",
+};
+
+/*
+ * Column name of hardware counter i, which is its name in pmu_names with
+ * '-' spelled as '_', so that it is a plain identifier in CSV and JSON.
+ */
+#define PMU_KEY_LEN 32
+static const char *pmu_key(int i, char buf[PMU_KEY_LEN])
+{
+    size_t n = 0;
+    for (const char *c = pmu_names[i]; *c && n < PMU_KEY_LEN - 1; c++)
+        buf[n++] = *c == '-' ? '_' : *c;
+    buf[n] = '\0';
+    return buf;
+}
+
+static unsigned bucket_of(uint64_t v)
+{
+    if (v < (1 << STAT_SUB_BITS))
+        return v;
+    unsigned shift = 63 - __builtin_clzll(v) - (STAT_SUB_BITS - 1);
+    return shift * STAT_SUB_HALF + (v >> shift);
+}
+
+/* Highest value that falls into bucket b */
+static uint64_t bucket_top(unsigned b)
+{
+    if (b < (1 << STAT_SUB_BITS))
+        return b;
+    unsigned shift = b / STAT_SUB_HALF - 1;
+    uint64_t low = (uint64_t) (b - shift * STAT_SUB_HALF) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+void stats_pmu_begin(void)
+{
+    pmu_started = pmu_read(&pmu_start);
+}
+
+void stats_record(stat_op_t op, int64_t cycles)
+{
+    pmu_sample_t end;
+    if (pmu_started && pmu_enabled && pmu_read(&end)) {
+        for (int i = 0; i < PMU_NR; i++)
+            pmu_totals[op].sums[i] += end.v[i] - pmu_start.v[i];
+        pmu_totals[op].samples++;
+    }
+    pmu_started = false;
+
+    /* The cycle counter may step back when the thread changes CPU */
+    uint64_t v = cycles > 0 ? cycles : 0;
+    histogram_t *h = &histograms[op];
+    h->counts[bucket_of(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void stats_reset(void)
+{
+    memset(histograms, 0, sizeof(histograms));
+    memset(pmu_totals, 0, sizeof(pmu_totals));
+}
+
+/* Smallest value that at least a fraction q of the samples do not exceed */
+static uint64_t quantile(const histogram_t *h, double q)
+{
+    uint64_t rank = (uint64_t) (q * h->total);
+    if (rank < q * h->total)
+        rank++;
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < STAT_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Append the mean counter values of op to the output line */
+static void print_pmu(stats_format_t fmt, FILE *f, int op)
+{
+    const pmu_totals_t *t = &pmu_totals[op];
+    char key[PMU_KEY_LEN];
+    for (int i = 0; i < PMU_NR; i++) {
+        double mean = t->samples ? (double) t->sums[i] / t->samples : 0;
+        if (fmt == STATS_TEXT)
+            report_noreturn(1, " %13.1f", mean);
+        else if (fmt == STATS_CSV)
+            fprintf(f, ",%.1f", mean);
+        else
+            fprintf(f, ", \"%s\": %.1f", pmu_key(i, key), mean);
+    }
+}
+
+bool stats_print(stats_format_t fmt, FILE *f)
+{
+    bool first = true;
+
+    bool with_pmu = false;
+    for (int op = 0; op < STAT_NR; op++)
+        with_pmu = with_pmu || pmu_totals[op].samples;
+
+    if (fmt == STATS_TEXT)
+        report_noreturn(1, "%-8s %10s %10s %10s %10s %10s %12s", "op",
+                        "count", "mean", "p50", "p99", "p999", "max");
+    else if (fmt == STATS_CSV)
+        fprintf(f, "op,count,mean,p50,p99,p999,max");
+    else
+        fprintf(f, "{\"unit\": \"cycles\", \"ops\": [");
+    char key[PMU_KEY_LEN];
+    for (int i = 0; with_pmu && fmt != STATS_JSON && i < PMU_NR; i++) {
+        if (fmt == STATS_TEXT)
+            report_noreturn(1, " %13s", pmu_key(i, key));
+        else
+            fprintf(f, ",%s", pmu_key(i, key));
+    }
+    if (fmt == STATS_TEXT)
+        report(1, "");
+    else if (fmt == STATS_CSV)
+        fprintf(f, "\n");
+
+    for (int op = 0; op < STAT_NR; op++) {
+        const histogram_t *h = &histograms[op];
+        if (!h->total)
+            continue;
+
+        unsigned long long mean = h->sum / h->total;
+        unsigned long long p50 = quantile(h, 0.5);
+        unsigned long long p99 = quantile(h, 0.99);
+        unsigned long long p999 = quantile(h, 0.999);
+        unsigned long long max = h->max;
+        unsigned long long count = h->total;
+        switch (fmt) {
+        case STATS_TEXT:
+            report_noreturn(1,
+                            "%-8s %10llu %10llu %10llu %10llu %10llu %12llu",
+                            stat_names[op], count, mean, p50, p99, p999, max);
+            break;
+        case STATS_CSV:
+            fprintf(f, "%s,%llu,%llu,%llu,%llu,%llu,%llu", stat_names[op],
+                    count, mean, p50, p99, p999, max);
+            break;
+        case STATS_JSON:
+            fprintf(f,
+                    "%s\n  {\"op\": \"%s\", \"count\": %llu, \"mean\": %llu, "
+                    "\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, "
+                    "\"max\": %llu",
+                    first ? "" : ",", stat_names[op], count, mean, p50, p99,
+                    p999, max);
+            break;
+        }
+        if (with_pmu)
+            print_pmu(fmt, f, op);
+        if (fmt == STATS_TEXT)
+            report(1, "");
+        else
+            fprintf(f, fmt == STATS_CSV ? "\n" : "}");
+        first = false;
+    }
+
+    if (fmt == STATS_TEXT)
+        return true;
+    if (fmt == STATS_JSON)
+        fprintf(f, "%s]}\n", first ? "" : "\n");
+    return !fflush(f) && !ferror(f);
+}
@@ -0,0 +1,80 @@
+#ifndef LAB0_STATS_H
+#define LAB0_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpucycles.h"
+#include "pmu.h"
+
+/*
+ * Latency histograms of queue operations, measured in CPU cycles.
+ *
+ * Buckets are log-linear in the manner of HdrHistogram: values below
+ * 2^STAT_SUB_BITS have a bucket each, and every further power of two is
+ * split into 2^(STAT_SUB_BITS - 1) buckets.  Any recorded value is then
+ * known to within about 6%, whatever its magnitude.
+ *
+ * With option pmu set, each operation also accumulates the hardware
+ * counters of pmu.h.  Reading them costs a system call on either side,
+ * which then shows in the cycle counts as well.
+ */
+
+/* Operations being measured */
+typedef enum {
+    STAT_NEW,
+    STAT_FREE,
+    STAT_IH,
+    STAT_IT,
+    STAT_IH_BULK,
+    STAT_IT_BULK,
+    STAT_RH,
+    STAT_RT,
+    STAT_RHN,
+    STAT_SIZE,
+    STAT_REVERSE,
+    STAT_REVERSEK,
+    STAT_SORT,
+    STAT_DM,
+    STAT_DEDUP,
+    STAT_SWAP,
+    STAT_MERGE,
+    STAT_SPLIT,
+    STAT_NR,
+} stat_op_t;
+
+typedef enum { STATS_TEXT, STATS_CSV, STATS_JSON } stats_format_t;
+
+/*
+ * Add one sample of the given number of cycles, along with the counters
+ * since stats_begin when they are enabled.
+ */
+void stats_record(stat_op_t op, int64_t cycles);
+
+/* Take the counters at the start of an operation */
+void stats_pmu_begin(void);
+
+/* Time a queue call: t = stats_begin(); q_xxx(...); stats_end(op, t); */
+static inline int64_t stats_begin(void)
+{
+    if (pmu_enabled)
+        stats_pmu_begin();
+    return cpucycles();
+}
+
+static inline void stats_end(stat_op_t op, int64_t start)
+{
+    stats_record(op, cpucycles() - start);
+}
+
+/* Drop all samples */
+void stats_reset(void);
+
+/*
+ * Write count, mean and p50/p99/p999/max of each measured operation, and
+ * the mean of each hardware counter if any were taken.
+ * Text goes through report, CSV and JSON to f.
+ */
+bool stats_print(stats_format_t fmt, FILE *f);
+
+#endif /* LAB0_STATS_H */
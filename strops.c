@@ -0,0 +1,443 @@
+#include "strops.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STROPS_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define STROPS_NEON
+#endif
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+void str_rng_seed(str_rng_t *r, uint64_t seed)
+{
+    /* SplitMix64 spreads the seed over the state, which is never all zero */
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        r->s[i] = z ^ (z >> 31);
+    }
+}
+
+uint64_t str_rng_next(str_rng_t *r)
+{
+    uint64_t *s = r->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/*
+ * Scalar kernels, also used for the short ends the vector kernels leave.
+ */
+
+/* Copy n bytes with at most two, possibly overlapping, word moves */
+static inline void copy_small(char *dst, const char *src, size_t n)
+{
+    if (n >= 8) {
+        uint64_t head, tail;
+        memcpy(&head, src, 8);
+        memcpy(&tail, src + n - 8, 8);
+        memcpy(dst, &head, 8);
+        memcpy(dst + n - 8, &tail, 8);
+    } else if (n >= 4) {
+        uint32_t head, tail;
+        memcpy(&head, src, 4);
+        memcpy(&tail, src + n - 4, 4);
+        memcpy(dst, &head, 4);
+        memcpy(dst + n - 4, &tail, 4);
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = src[i];
+        }
+    }
+}
+
+static void copy_scalar(char *dst, const char *src, size_t n)
+{
+    if (n < 16) {
+        copy_small(dst, src, n);
+        return;
+    }
+    memcpy(dst, src, n);
+}
+
+static inline int byte_diff(const char *a, const char *b, size_t i)
+{
+    return (unsigned char) a[i] - (unsigned char) b[i];
+}
+
+/* Compare 8 bytes as a big-endian word, so integer order is byte order */
+static inline int cmp_word(const char *a, const char *b)
+{
+    uint64_t x, y;
+    memcpy(&x, a, 8);
+    memcpy(&y, b, 8);
+    if (x == y) {
+        return 0;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+    y = __builtin_bswap64(y);
+#endif
+    return x < y ? -1 : 1;
+}
+
+/*
+ * Sign of the difference of the first bytes of a and b that differ,
+ * within n bytes, or 0.  Runs of 8 bytes are compared a word at a time,
+ * the last word overlapping the one before it.
+ */
+static int cmp_scalar(const char *a, const char *b, size_t n)
+{
+    if (n < 8) {
+        for (size_t i = 0; i < n; i++) {
+            if (a[i] != b[i]) {
+                return byte_diff(a, b, i);
+            }
+        }
+        return 0;
+    }
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int cmp = cmp_word(a + i, b + i);
+        if (cmp) {
+            return cmp;
+        }
+    }
+    return i < n ? cmp_word(a + n - 8, b + n - 8) : 0;
+}
+
+/* Map a random byte to a letter, without the bias of a modulo */
+static inline char lower_of(uint64_t w, int i)
+{
+    return 'a' + (char) ((((w >> (8 * i)) & 0xff) * 26) >> 8);
+}
+
+static void lower_scalar(str_rng_t *r, char *buf, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = str_rng_next(r);
+        for (int j = 0; j < 8; j++) {
+            buf[i + j] = lower_of(w, j);
+        }
+    }
+    if (i < len) {
+        uint64_t w = str_rng_next(r);
+        for (int j = 0; i < len; i++, j++) {
+            buf[i] = lower_of(w, j);
+        }
+    }
+}
+
+#ifdef STROPS_X86
+__attribute__((target("sse2"))) static void copy_sse2(char *dst,
+                                                       const char *src,
+                                                       size_t n)
+{
+    if (n < 16) {
+        copy_small(dst, src, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm_storeu_si128((__m128i *) (dst + i),
+                         _mm_loadu_si128((const __m128i *) (src + i)));
+    }
+    /* The last vector overlaps the previous one instead of going past n */
+    if (i < n) {
+        _mm_storeu_si128((__m128i *) (dst + n - 16),
+                         _mm_loadu_si128((const __m128i *) (src + n - 16)));
+    }
+}
+
+/* Mask of the bytes in which the 16 bytes at a and b differ */
+__attribute__((target("sse2"))) static inline unsigned int ne_sse2(
+    const char *a,
+    const char *b)
+{
+    __m128i va = _mm_loadu_si128((const __m128i *) a);
+    __m128i vb = _mm_loadu_si128((const __m128i *) b);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff;
+}
+
+__attribute__((target("sse2"))) static int cmp_sse2(const char *a,
+                                                     const char *b,
+                                                     size_t n)
+{
+    if (n < 16) {
+        return cmp_scalar(a, b, n);
+    }
+    size_t i = 0;
+    for (; n - i > 32; i += 16) {
+        unsigned int ne = ne_sse2(a + i, b + i);
+        if (ne) {
+            return byte_diff(a, b, i + __builtin_ctz(ne));
+        }
+    }
+    /*
+     * The last 16 to 32 bytes are covered by two vectors, the second one
+     * ending at n.  Shifted into place, the masks give the first differing
+     * byte without a branch on where the string ends.
+     */
+    uint32_t ne = ne_sse2(a + i, b + i) |
+                  ((uint32_t) ne_sse2(a + n - 16, b + n - 16) << (n - i - 16));
+    return ne ? byte_diff(a, b, i + __builtin_ctz(ne)) : 0;
+}
+
+/* Scale 16 random bytes to letters in 16-bit lanes, as lower_of() does */
+__attribute__((target("sse2"))) static void lower_sse2(str_rng_t *r,
+                                                        char *buf,
+                                                        size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i letters = _mm_set1_epi16(26);
+    const __m128i a = _mm_set1_epi8('a');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint64_t w0 = str_rng_next(r), w1 = str_rng_next(r);
+        __m128i v = _mm_set_epi64x((long long) w1, (long long) w0);
+        __m128i lo = _mm_srli_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), letters), 8);
+        __m128i hi = _mm_srli_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), letters), 8);
+        _mm_storeu_si128((__m128i *) (buf + i),
+                         _mm_add_epi8(_mm_packus_epi16(lo, hi), a));
+    }
+    lower_scalar(r, buf + i, len - i);
+}
+
+__attribute__((target("avx2"))) static void copy_avx2(char *dst,
+                                                       const char *src,
+                                                       size_t n)
+{
+    if (n < 32) {
+        copy_sse2(dst, src, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        _mm256_storeu_si256((__m256i *) (dst + i),
+                            _mm256_loadu_si256((const __m256i *) (src + i)));
+    }
+    if (i < n) {
+        _mm256_storeu_si256(
+            (__m256i *) (dst + n - 32),
+            _mm256_loadu_si256((const __m256i *) (src + n - 32)));
+    }
+    _mm256_zeroupper();
+}
+
+__attribute__((target("avx2"))) static inline uint32_t ne_avx2(
+    const char *a,
+    const char *b)
+{
+    __m256i va = _mm256_loadu_si256((const __m256i *) a);
+    __m256i vb = _mm256_loadu_si256((const __m256i *) b);
+    return ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+}
+
+__attribute__((target("avx2"))) static int cmp_avx2(const char *a,
+                                                     const char *b,
+                                                     size_t n)
+{
+    if (n < 32) {
+        return cmp_sse2(a, b, n);
+    }
+    size_t i = 0;
+    uint64_t ne = 0;
+    for (; n - i > 64; i += 32) {
+        if ((ne = ne_avx2(a + i, b + i))) {
+            break;
+        }
+    }
+    /* The last 32 to 64 bytes, as in cmp_sse2() */
+    if (!ne) {
+        ne = ne_avx2(a + i, b + i) |
+             ((uint64_t) ne_avx2(a + n - 32, b + n - 32) << (n - i - 32));
+    }
+    /*
+     * GCC leaves the upper halves dirty on early returns, which makes
+     * every SSE instruction after it pay for a state transition.
+     */
+    _mm256_zeroupper();
+    return ne ? byte_diff(a, b, i + __builtin_ctzll(ne)) : 0;
+}
+#endif /* STROPS_X86 */
+
+#ifdef STROPS_NEON
+static void copy_neon(char *dst, const char *src, size_t n)
+{
+    if (n < 16) {
+        copy_small(dst, src, n);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        vst1q_u8((uint8_t *) dst + i, vld1q_u8((const uint8_t *) src + i));
+    }
+    if (i < n) {
+        vst1q_u8((uint8_t *) dst + n - 16,
+                 vld1q_u8((const uint8_t *) src + n - 16));
+    }
+}
+
+static int cmp_neon(const char *a, const char *b, size_t n)
+{
+    if (n < 16) {
+        return cmp_scalar(a, b, n);
+    }
+    for (size_t i = 0;; i += 16) {
+        if (i + 16 > n) {
+            i = n - 16;
+        }
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *) a + i),
+                                 vld1q_u8((const uint8_t *) b + i));
+        /* Narrow the byte mask to four bits per byte */
+        uint64_t ne = ~vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (ne) {
+            return byte_diff(a, b, i + __builtin_ctzll(ne) / 4);
+        }
+        if (i + 16 == n) {
+            return 0;
+        }
+    }
+}
+
+static void lower_neon(str_rng_t *r, char *buf, size_t len)
+{
+    const uint8x8_t letters = vdup_n_u8(26);
+    const uint8x16_t a = vdupq_n_u8('a');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x8_t w0 = vcreate_u8(str_rng_next(r));
+        uint8x8_t w1 = vcreate_u8(str_rng_next(r));
+        uint8x16_t v = vcombine_u8(vshrn_n_u16(vmull_u8(w0, letters), 8),
+                                   vshrn_n_u16(vmull_u8(w1, letters), 8));
+        vst1q_u8((uint8_t *) buf + i, vaddq_u8(v, a));
+    }
+    lower_scalar(r, buf + i, len - i);
+}
+#endif /* STROPS_NEON */
+
+static struct {
+    const char *name;
+    void (*copy)(char *dst, const char *src, size_t n);
+    int (*cmp)(const char *a, const char *b, size_t n);
+    void (*lower)(str_rng_t *r, char *buf, size_t len);
+} kernels = {"scalar", copy_scalar, cmp_scalar, lower_scalar};
+
+/* Pick the kernels before main(), so that threads only ever read them */
+__attribute__((constructor)) static void strops_init()
+{
+#if defined(STROPS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.name = "avx2";
+        kernels.copy = copy_avx2;
+        kernels.cmp = cmp_avx2;
+        /* Generating the random words is the bottleneck, not the mapping */
+        kernels.lower = lower_sse2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernels.name = "sse2";
+        kernels.copy = copy_sse2;
+        kernels.cmp = cmp_sse2;
+        kernels.lower = lower_sse2;
+    }
+#elif defined(STROPS_NEON)
+    kernels.name = "neon";
+    kernels.copy = copy_neon;
+    kernels.cmp = cmp_neon;
+    kernels.lower = lower_neon;
+#endif
+}
+
+size_t str_copy_out(char *dst, const char *src, size_t len, size_t bufsize)
+{
+    size_t n = len < bufsize - 1 ? len : bufsize - 1;
+    kernels.copy(dst, src, n);
+    dst[n] = '\0';
+    return n;
+}
+
+int str_compare(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int cmp = kernels.cmp(a, b, alen < blen ? alen : blen);
+    if (cmp) {
+        return cmp;
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+void str_fill_lower(str_rng_t *r, char *buf, size_t len)
+{
+    kernels.lower(r, buf, len);
+}
+
+const char *str_kernels()
+{
+    return kernels.name;
+}
+
+static inline int sign(int v)
+{
+    return (v > 0) - (v < 0);
+}
+
+/* Strings of every length up to this are cross-checked by str_check() */
+#define CHECK_LEN 80
+
+bool str_check()
+{
+    char a[CHECK_LEN], b[CHECK_LEN];
+    /* Room for a guard byte past the copy */
+    char x[CHECK_LEN + 1], y[CHECK_LEN + 1];
+
+    for (size_t n = 0; n <= CHECK_LEN; n++) {
+        /* The same letters, and the generators left in the same state */
+        str_rng_t r, s;
+        str_rng_seed(&r, n);
+        str_rng_seed(&s, n);
+        kernels.lower(&r, a, n);
+        lower_scalar(&s, b, n);
+        if (memcmp(a, b, n) || str_rng_next(&r) != str_rng_next(&s)) {
+            return false;
+        }
+
+        memset(x, 0x5a, sizeof(x));
+        memset(y, 0x5a, sizeof(y));
+        kernels.copy(x, a, n);
+        copy_scalar(y, a, n);
+        if (memcmp(x, y, sizeof(x))) {
+            return false;
+        }
+
+        if (kernels.cmp(a, b, n) != 0) {
+            return false;
+        }
+        /* A difference at every position, either way and above 0x7f */
+        for (size_t i = 0; i < n; i++) {
+            b[i] = a[i] ^ 0x80;
+            if (sign(kernels.cmp(a, b, n)) != sign(cmp_scalar(a, b, n)) ||
+                sign(kernels.cmp(b, a, n)) != sign(cmp_scalar(b, a, n))) {
+                return false;
+            }
+            b[i] = a[i];
+        }
+    }
+    return true;
+}
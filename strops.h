@@ -0,0 +1,58 @@
+#ifndef LAB0_STROPS_H
+#define LAB0_STROPS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * String kernels for the hot paths of the queue, qtest and qbench.
+ *
+ * Each kernel comes in a scalar version and in SSE2, AVX2 or NEON versions
+ * where the target has them.  The best one the CPU supports is picked once
+ * at startup, str_kernels() tells which.  All versions give the same
+ * results, down to the random strings drawn from a given seed.
+ *
+ * The kernels take string lengths from the caller, see q_element_len(), so
+ * that they never read past the end of a string nor write past the end of
+ * what they copy.
+ */
+
+/* State of a xoshiro256** generator */
+typedef struct {
+    uint64_t s[4];
+} str_rng_t;
+
+/* Seed r, any seed including 0 gives a usable state */
+void str_rng_seed(str_rng_t *r, uint64_t seed);
+
+/* Return the next 64 random bits of r */
+uint64_t str_rng_next(str_rng_t *r);
+
+/*
+ * Copy the len bytes string src to dst, which has room for bufsize bytes.
+ * Copy at most bufsize-1 bytes, then a null terminator, and do not touch
+ * dst beyond it.  bufsize must be at least 1.
+ * Return the number of bytes copied, terminator not counted.
+ */
+size_t str_copy_out(char *dst, const char *src, size_t len, size_t bufsize);
+
+/*
+ * Compare the strings a and b, alen and blen bytes long, like strcmp().
+ * Return a negative, zero or positive value, as strcmp() would.
+ */
+int str_compare(const char *a, size_t alen, const char *b, size_t blen);
+
+/* Fill buf with len random lowercase letters drawn from r, no terminator */
+void str_fill_lower(str_rng_t *r, char *buf, size_t len);
+
+/* Name of the kernels in use: "avx2", "sse2", "neon" or "scalar" */
+const char *str_kernels();
+
+/*
+ * Run the kernels in use and the scalar ones on the same strings, of every
+ * length up to 80 bytes.  Return false if their results differ anywhere.
+ */
+bool str_check();
+
+#endif /* LAB0_STROPS_H */
@@ -0,0 +1,30 @@
+# Operations compiled and replayed by trace-19-replay
+new
+ih dolphin
+ih bear
+it gerbil
+reverse
+rh gerbil
+sort
+rh bear
+rt dolphin
+it RAND 5
+size
+queues
+rhn 5
+new ring
+it meerkat 3
+ih bear
+rh bear
+rt meerkat
+size
+queues
+new compact
+ih vulture
+it squirrel
+rh vulture
+rh squirrel
+new
+it gerbil
+rh gerbil
+free
@@ -0,0 +1,34 @@
+# Test of remove_head_n and dedup of unsorted queues
+option fail 10
+option malloc 0
+new
+rhn 0
+rhn 3
+dedup unsorted
+size
+it a
+it b
+it c
+it d
+it e
+rhn 2
+rh c
+rhn 0
+rhn 5
+rh
+ih gerbil
+it bear
+it dolphin
+it bear
+it gerbil
+it meerkat
+it bear
+dedup unsorted
+rh dolphin
+rh meerkat
+rh
+it vulture
+it vulture
+dedup unsorted
+rh
+free
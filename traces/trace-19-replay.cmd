@@ -0,0 +1,8 @@
+# Test of compiling a trace and replaying it on each queue backend
+option fail 0
+option malloc 0
+compile traces/replay-ops.cmd /tmp/qtest.replay 1
+replay /tmp/qtest.replay
+show
+new
+replay /tmp/qtest.replay
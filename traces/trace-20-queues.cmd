@@ -0,0 +1,52 @@
+# Test of several queues with add, select, merge, split and queues
+option fail 0
+option malloc 0
+new
+it bear
+it gerbil
+add
+it dolphin
+it meerkat
+it vulture
+add
+queues
+merge
+queues
+rh bear
+rh dolphin
+rh gerbil
+rh meerkat
+rh vulture
+select 0
+size
+merge 0
+it b
+it a
+it c
+sort
+merge 0
+split 2
+queues
+rh a
+rh b
+select 3
+rh c
+add
+split 3
+queues
+select 0
+ih e
+ih d
+merge 0 1
+split 1
+rh d
+rh e
+free
+select 1
+free
+select 2
+free
+add ring
+it x
+queues
+free
@@ -0,0 +1,65 @@
+# Test of reverseK and swap with group sizes
+option fail 0
+option malloc 0
+new
+reverseK 2
+swap 2
+it a
+it b
+it c
+it d
+it e
+it f
+it g
+reverseK 3
+rh c
+rh b
+rh a
+rh f
+rh e
+rh d
+rh g
+it a
+it b
+it c
+reverseK 4
+rh a
+rh b
+rh c
+it a
+it b
+it c
+reverseK 1
+rh a
+rh b
+rh c
+it a
+it b
+it c
+it d
+it e
+it f
+it g
+swap 2
+rh c
+rh d
+rh a
+rh b
+rh e
+rh f
+rh g
+it a
+it b
+it c
+swap 3
+rh a
+rh b
+rh c
+it a
+it b
+it c
+swap 1
+rh b
+rh a
+rh c
+free
@@ -0,0 +1,35 @@
+# Test of insert, remove, sort and reverse on a compact queue
+option fail 0
+option malloc 0
+new compact
+sort
+reverse
+it dolphin
+ih bear
+it a_string_longer_than_a_compact_node
+ih gerbil
+it bear
+mem
+sort
+rh a_string_longer_than_a_compact_node
+rh bear
+rh bear
+rh dolphin
+rh gerbil
+it meerkat
+it vulture
+ih squirrel
+it a_string_longer_than_a_compact_node
+reverse
+rh a_string_longer_than_a_compact_node
+rh vulture
+rh meerkat
+rh squirrel
+size
+ih RAND 3000
+sort
+reverse
+it zebra
+reverse
+rh zebra
+free
@@ -0,0 +1,46 @@
+# Test of saving queues and loading them back in place of their contents
+option fail 0
+option malloc 0
+new
+save /tmp/qtest.snap
+it gerbil
+load /tmp/qtest.snap
+it a
+it a_string_longer_than_any_inline_buffer
+it c
+save /tmp/qtest.snap
+rh a
+it extra
+load /tmp/qtest.snap
+it z
+rh a
+rh a_string_longer_than_any_inline_buffer
+rh c
+rh z
+free
+new ring
+it d
+it e
+ih f
+save /tmp/qtest.snap
+rh f
+load /tmp/qtest.snap
+it z
+rh f
+rh d
+rh e
+rh z
+free
+new compact
+it g
+it a_string_longer_than_a_compact_node
+ih h
+save /tmp/qtest.snap
+it extra
+load /tmp/qtest.snap
+it z
+rh h
+rh g
+rh a_string_longer_than_a_compact_node
+rh z
+free